@@ -39,6 +39,10 @@ class Aux
 public:
   Queue<uint8_t,64> txqueue;
   Queue<uint8_t,128> rxqueue;
+#ifndef __AVR_ARCH__
+  FILE *outfile; // send() writes to stdout if this is NULL
+  void flush();   // writes out what send() has buffered
+#endif
   void init();
   bool rxready();
   uint8_t receive();
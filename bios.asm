@@ -225,12 +225,46 @@ initcpm:
 	ld	(5),a		;for jmp to bdos
 	ld	hl, bdos	;bdos entry point
 	ld	(6),hl		;address field of Jump at 5 to bdos
+	ld	a,(hostfs)	;machine serves a drive from host directory?
+	or	a
+	jr	z,icpm1
+	ld	hl,(bdos+1)	;yes, hook its bdos calls in front of bdos
+	ld	(hbdos1+1),hl	;keeping page 0 jump so that top of TPA
+	ld	hl,hostbdos	;stays where it was
+	ld	(bdos+1),hl
+icpm1:
 	ld	bc, 0x0080	;default dma address is 80h
 	call	_setdma
 	ld	a,(sekdsk)	;get current disk number
 	ld	c, a		;send to the ccp
 	jp	ccp		;start command processor
 
+; BDOS entry when machine has a host drive. disk functions go to the
+; machine first, and those not for host drive continue to the BDOS
+hostbdos:
+	ld	a,c
+	cp	13		;reset disk system is first disk function
+	jr	c,hbdos1
+	cp	41		;write random with zero fill is last
+	jr	nc,hbdos1
+	ld	(bdosfn),a
+	ld	(bdosde),de
+	ld	a,9		;command 9 - BDOS call for host drive
+	out	(A_MSCC),a
+	ld	hl,bdospb	;machine gets function and DE from here
+	ld	a,l
+	out	(A_MSCD),a
+	ld	a,h
+	out	(A_MSCD),a
+	in	a,(A_MSCD)	;nonzero if machine did it
+	or	a
+	jr	z,hbdos1
+	ld	hl,(bdosret)	;return like BDOS does, in HL, A=L, B=H
+	ld	a,l
+	ld	b,h
+	ret
+hbdos1:	jp	0		;set to BDOS entry by initcpm
+
 ; Console status
 ; Returns its status in A; 0 if no character is ready, 0FFh if one is.
 _const:	in     	a,(A_CONS)
@@ -298,7 +332,9 @@ _reader:
 
 ; home the selected disk, in old times that just did the seek
 ; to track 0. this is called relatively often, so we are
-; using it to also flush unwritten host sector to SD card
+; using it to also flush unwritten host sector to SD card.
+; emulator syncs its card image on its own, doing it here
+; would cost a host sync on every BDOS directory search
 ;
 _home:	call	writeback
 	ld	bc,0
@@ -370,7 +406,13 @@ _sectran:
 	ret
 
 ; read sector at sekdsk,sektrk,seksec into buffer set by setdma
-_read:	call	checkbuf	;ensure correct host sector is in buffer
+_read:	ld	a,7		;machine can do the deblocking itself
+	call	hostrec
+	inc	a
+	jr	z,_read1	;0xff, it can not
+	dec	a
+	ret
+_read1:	call	checkbuf	;ensure correct host sector is in buffer
 	or	a		;failures are actually rather fatal
 	ret	nz		;but we'll let BDOS handle the errors
 	ld	bc,128		;logical sector size
@@ -390,7 +432,13 @@ _read:	call	checkbuf	;ensure correct host sector is in buffer
 ;     anyway, so in my code i'm just prereading in all cases as the SD card
 ;     is super fast compared to floppies
 
-_write:	call	checkbuf	;ensure correct host sector is in buffer
+_write:	ld	a,8		;machine can do the deblocking itself
+	call	hostrec
+	inc	a
+	jr	z,_write1	;0xff, it can not
+	dec	a
+	ret
+_write1: call	checkbuf	;ensure correct host sector is in buffer
 	or	a
 	ret	nz
 	push	bc
@@ -405,6 +453,32 @@ _write:	call	checkbuf	;ensure correct host sector is in buffer
 	ret	nz		;no, all done
 	jp	writeback	;otherwise write to card immediately
 
+; have the machine transfer the record between card and dmaadr, doing the
+; deblocking on its side. A is the SD command, 7 for read and 8 for write.
+; returns status in A, 0xff if this has to be done here because the machine
+; does not support it or the host buffer has not been written back yet
+hostrec:
+	push	bc
+	ld	b,a
+	ld	a,(bufmod)
+	or	a
+	ld	a,0xff
+	jr	nz,hrec1
+	ld	hl,diskpb	;machine reads disk, track, sector and dma from here
+	ld	a,l
+	out	(A_SDA0),a
+	ld	a,h
+	out	(A_SDA1),a
+	ld	a,b
+	call	sdcmd
+	cp	0xff
+	jr	z,hrec1
+	ld	hl,0xffff	;host buffer may now be out of date
+	ld	(buflba_h),hl
+hrec1:	pop	bc
+	or	a
+	ret
+
 ; ensure that host buffer has wanted host sector in it
 ; if a new sector is needed then checks the buffer status and
 ; writes the contents to media if the buffer has changed
@@ -524,56 +598,49 @@ writeback:
 	ret
 
 
-; reading and writing is done by first setting sector number, then writing
-; command (0 for read, 1 for write) to A_SDC. for write the next step is to
-; write 512 bytes to the data register. After that A_SDC needs to be
-; read until its high bit becomes set to indicate operation has completed.
-; zero value read from A_SDS means that operation was successful, and for
-; read operation 512 data bytes may now be read from A_SDD.
+; sectors are transferred with the DMA commands, the machine copies
+; sector data between card and memory itself. sector number, memory
+; address and sector count are set first, then command (5 for read, 6 for
+; write) is written to A_SDC. After that A_SDC needs to be read until its
+; high bit becomes set to indicate operation has completed. zero value read
+; from A_SDS means that operation was successful.
 ;
 
 ; write data from BC to physical sector given by DEHL
 ; returns result code in A. 0 means success
 ;
 writesector:
-	call	setsadr
 	ld	a,1
-	out	(A_SDC),a
-	ld	h,b
-	ld	l,c
-	ld	b,0
-	ld	c,A_SDD
-	otir		; write 256 data bytes
-	otir		; and second half
-ws1:	in	a,(A_SDC)
-	and	0x80
-	jr	z,ws1   ; not done yet
-	in	a,(A_SDS)
-	and	a
-	ret
+; write A sectors from BC to physical sectors starting from DEHL
+writesectors:
+	call	setdma
+	ld	a,6
+	jr	sdcmd
 
 ; read physical sector given by DEHL to address given by BC
 ; returns result code in A, if result is 0 then data is read
 ;
 readsector:
-	call	setsadr
-	xor	a
-	out	(A_SDC),a
+	ld	a,1
+; read A sectors starting from DEHL to address given by BC
+readsectors:
+	call	setdma
+	ld	a,5
+sdcmd:	out	(A_SDC),a
 rs1:	in	a,(A_SDC) ; poll for command completed
 	and	0x80
 	jr	z,rs1
 	in	a,(A_SDS) ; get status
 	or	a
-	ret	nz
-	ld	h,b
-	ld	l,c
-	ld	b,0
-	ld	c,A_SDD
-	inir		  ;read 256 bytes
-	inir		  ;and again
-	xor	a
 	ret
 
+; set sector number from DEHL, memory address from BC and sector count
+; from A
+setdma:	out	(A_SDN),a
+	ld	a,c
+	out	(A_SDA0),a
+	ld	a,b
+	out	(A_SDA1),a	;and on to set sector number
 setsadr:
 	ld	a,d
 	out	(A_SD3),a
@@ -596,13 +663,25 @@ pstr:   ld      a,(hl)
         inc     hl
         jr      pstr
 
+; parameter block for machine side deblocking, see hostrec
+diskpb:
 dsklba_l:   dw 	0 ; first LBA sector of currently selected disk
 dsklba_h:   dw	0
+sekdsk:	    db	0 ; seek disk number
+sektrk:	    dw	0 ; seek track number
+seksec:	    db	0 ; seek sector number
+dmaadr:	    dw	0 ; last dma address
 firstlba_l: dw	0 ; first LBA sector of CP/M partition on the card
 firstlba_h: dw	0
 buflba_l:   dw	0 ; LBA sector that is currently in hstbuf
 buflba_h:   dw	0
 bufmod:	    db	0 ; nonzero means the sector as been modified
+hostfs:	    db	0 ; nonzero if machine has a host drive
+; parameter block for host drive BDOS calls, see hostbdos
+bdospb:
+bdosfn:	    db	0 ; BDOS function
+bdosde:	    dw	0 ; BDOS parameter
+bdosret:    dw	0 ; result from machine
 ;
 ;*****************************************************
 ;*                                                   *
@@ -631,11 +710,6 @@ all13:  ds      (diskblocks/8)              ;N
 all14:  ds      (diskblocks/8)              ;O
 all15:  ds      (diskblocks/8)              ;P
 
-sekdsk:	ds	1		;seek disk number
-sektrk:	ds	2		;seek track number
-seksec:	ds	1		;seek sector number
-dmaadr:	ds	2		;last dma address
-
 ; host sector buffer has 512 bytes of space that will be overwritten
 ; after boot, using this for one-off stuff happening at cold boot only.
 ; if needed, directory buffer and allocation vector area could be used similarily.
@@ -667,6 +741,10 @@ welcome:
 	ld	(buflba_l),hl	;cp/m should never try accessing partition
 	ld	(buflba_h),hl	;table as the first thing, so this should be
 				;safe starting point
+	ld	a,8		;command 8 - ask for host drive,
+	out	(A_MSCC),a	;machines without one read back 0
+	in	a,(A_MSCD)
+	ld	(hostfs),a
 	ld	hl,0
 	ld	(_bootx),hl	;ensure this code is no longer called
 	ld	(_bootx+1),hl   ;by modifying cold boot function 
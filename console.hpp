@@ -44,7 +44,14 @@ uint8_t row,tickcount;
   void outputint(int32_t n);
   void kpushn(int16_t n);
 public:
+#ifdef __AVR_ARCH__
   Queue<uint8_t,64> txqueue,rxqueue;
+#else
+  Queue<uint8_t,64> txqueue;
+  Ring<uint8_t,4096> rxqueue; // filled by host input thread
+  FILE *outfile; // send() writes to stdout if this is NULL
+  void flush();   // writes out what send() has buffered
+#endif
 
   void init();
   bool rxready();
@@ -37,6 +37,8 @@ static uint8_t auxbaud;
 static uint8_t sd0,sd1,sd2,sd3,sds;
 static uint8_t sdc;
 static uint16_t dataofs;
+static uint16_t sda; // DMA address
+static uint8_t sdn;  // DMA sector count
 static MSTATE state;
 static uint16_t count;
 
@@ -257,10 +259,51 @@ uint8_t b=0;
     case 0xae:
       b=sd3;
       break;
+    case 0xa6:
+      b=sda;
+      break;
+    case 0xa7:
+      b=sda>>8;
+      break;
+    case 0xaf:
+      b=sdn;
+      break;
   }
   return b;
 }
 
+// DMA commands, transfer sdn sectors between card and memory at sda
+static uint8_t sdtransfer(bool write)
+{
+uint32_t lba=(uint32_t)sd3<<24|(uint32_t)sd2<<16|(uint32_t)sd1<<8|sd0;
+uint8_t r=0;
+uint16_t i;
+  while (sdn) {
+    if (write) {
+      for (i=0;i<512;i++)
+        sdcard.GetBuf()[i]=cpu.readram(sda+i);
+      r=sdcard.WriteSector(lba,sdcard.GetBuf());
+    }
+    else {
+      r=sdcard.ReadSector(lba,sdcard.GetBuf());
+      if (!r) {
+        for (i=0;i<512;i++)
+          cpu.writeram(sda+i,sdcard.GetBuf()[i]);
+      }
+    }
+    if (r)
+      break;
+    lba++;
+    sda+=512;
+    sdn--;
+  }
+  sd0=lba;
+  sd1=lba>>8;
+  sd2=lba>>16;
+  sd3=lba>>24;
+  return r;
+}
+
 static void io_write(uint16_t adr,uint8_t b)
 {
 uint32_t s;
@@ -396,6 +439,11 @@ uint8_t c;
           sds=sdcard.Init(true); // silent initialize
           sdc|=0x80;
           break;
+        case 5: // DMA read
+        case 6: // DMA write
+          sds=sdtransfer(b==6);
+          sdc|=0x80;
+          break;
         default: // unknowns
           sds=0xff;
           sdc|=0x80;
@@ -424,6 +472,15 @@ uint8_t c;
     case 0xae:
       sd3=b;
       break;
+    case 0xa6:
+      sda=(sda&0xff00)|b;
+      break;
+    case 0xa7:
+      sda=(sda&0xff)|(uint16_t)b<<8;
+      break;
+    case 0xaf:
+      sdn=b;
+      break;
   }
 }
 
@@ -31,13 +31,17 @@
 #include "z80.hpp"
 
 extern Console console;
+#ifdef __AVR_ARCH__
 extern z80 cpu;
+#endif
 
 extern const uint8_t monitor_bin[8192] PROGMEM;
 extern const uint8_t bootstrap_bin[128] PROGMEM;
 extern const uint8_t cpm_bin[8192] PROGMEM;
 
+#ifdef __AVR_ARCH__
 void initialize_machine(void);
 void copy_bootloader(void);
+#endif
 
 #endif
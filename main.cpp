@@ -116,7 +116,7 @@ int main(void)
   aux.init();
   console.print("\ec\x0f\e[H\e[2JZ80 emulator for AVR 1.0\r\n");
   sdcard.Init();
-  checkdisk();
+  checkdisk(sdcard,console);
   copy_bootloader();
   cpu.reset();
   while (1) {
@@ -0,0 +1,65 @@
+"""
+  The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+"""
+# create flag lookup tables for 8 bit add and substract, indexed by
+# carry<<16|a<<8|b. the result is cheap to compute so only the flags are
+# stored, F5 and F3 are left for the caller to keep
+
+SFLAG=0x80
+ZFLAG=0x40
+HFLAG=0x10
+PVFLAG=0x04
+NFLAG=0x02
+CFLAG=0x01
+
+def flags(a,b,s,f):
+  x=a^b^s
+  if s&0x80:
+    f|=SFLAG
+  if not s&0xff:
+    f|=ZFLAG
+  if s&0x100:
+    f|=CFLAG
+  if x&0x10:
+    f|=HFLAG
+  if (x^(x>>1))&0x80:
+    f|=PVFLAG
+  return f
+
+def table(name,op):
+  print("const uint8_t %s[0x20000] = {"%name)
+  for c in range(0,2):
+    for a in range(0,256):
+      r=[]
+      for b in range(0,256):
+        r.append("0x%02x"%op(a,b,c))
+      for i in range(0,256,16):
+        print("  %s,"%",".join(r[i:i+16]))
+  print("};")
+  print("")
+
+print("/* generated by mkalutables.py, do not edit */")
+print("#include \"z80_flags.h\"")
+print("")
+table("z80_addflags",lambda a,b,c: flags(a,b,a+b+c,0))
+table("z80_subflags",lambda a,b,c: flags(a,b,(a-b-c)&0xffff,NFLAG))
@@ -43,7 +43,8 @@ void createpartitionentry(PARTITION* p,uint8_t type,uint32_t firstlba,uint32_t c
   p->lbacount[3]=count>>24;
 }
 
-void initialize_directory_sectors(uint32_t firstsector,uint16_t count)
+void initialize_directory_sectors(SDCard &sdcard,Console &console,
+  uint32_t firstsector,uint16_t count)
 {
   memset(sdcard.GetBuf(),0xe5,512);
   while (count--) {
@@ -67,7 +68,7 @@ unstructured block storage (think of it as tape drive with 512 byte blocks).
 As even the drives are probably going to by a little bit more than a
 128M card has usable room for, 256MB SD card is the minimum requirement.
 */
-void checkdisk(void)
+void checkdisk(SDCard &sdcard,Console &console)
 {
 PARTITION *p=(PARTITION*)(&sdcard.GetBuf()[446]);
 uint8_t i;
@@ -83,7 +84,7 @@ uint32_t tape_sectors;
     sdcard.Invalidate();
     return;
   }
-  if (sdcard.GetTotalSectors()<265000U) {
+  if (sdcard.GetTotalSectors()<MINCARDSECTORS) {
     console.print("Card too small to be used (at least 256MB card required)\r\n");
     sdcard.Invalidate();
     return;
@@ -146,7 +147,7 @@ uint32_t tape_sectors;
     for (i=0;i<16;i++) {
       sector=1+128+(uint32_t)i*16512U; // starting from sector 1, 128 sectors for boot track
                                        // 16384+128 total sectors per drive
-      initialize_directory_sectors(sector,16384/512); // one 16K blocks for directory
+      initialize_directory_sectors(sdcard,console,sector,16384/512); // one 16K blocks for directory
 #ifdef __AVR_ARCH__
       wdt_reset();
       WDTCSR|=0x40;
@@ -24,7 +24,9 @@
 #define __partitioner_hpp__
 
 #include "sdcard.hpp"
-extern SDCard sdcard;
+
+// smallest card checkdisk() accepts, 16 drives and their boot tracks
+#define MINCARDSECTORS 265000U
 
 typedef struct {
   uint8_t status;
@@ -47,7 +49,8 @@ typedef struct {
 } DIRENTRY;
 
 void createpartitionentry(PARTITION* p,uint8_t type,uint32_t firstlba,uint32_t count);
-void initialize_directory_sectors(uint32_t firstsector,uint16_t count);
-void checkdisk(void);
+void initialize_directory_sectors(SDCard &sdcard,Console &console,
+  uint32_t firstsector,uint16_t count);
+void checkdisk(SDCard &sdcard,Console &console);
 
 #endif
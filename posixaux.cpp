@@ -26,8 +26,6 @@
 
 #define BAUDRATE 115200L
 
-Aux aux;
-
 // low-level serial port tx and rx queues
 
 void Aux::setspeed(uint32_t speed)
@@ -45,6 +43,8 @@ bool Aux::rxready()
   
 uint8_t Aux::receive()
 {
+  if (!rxready())
+    flush();
   while (!rxready()) {
   }
   // blocks caller until data is received
@@ -63,7 +63,12 @@ bool Aux::txfull()
 
 void Aux::send(uint8_t c)  
 {
-  printf("%c",c);
+  putc(c,outfile ? outfile : stdout);
+}
+
+void Aux::flush()
+{
+  fflush(outfile ? outfile : stdout);
 }
 
 void Aux::print(const char *s)
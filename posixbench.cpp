@@ -0,0 +1,172 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "posixmachine.hpp"
+
+/*
+Benchmark runner, zemu --bench suite. Each line of the suite file is one
+workload:
+
+  name image instructions input
+
+image is the SD card image, or base,delta like for the farm so that runs
+do not change the base image. instructions limits the run, 0 for no limit.
+the rest of the line is typed into the console, | stands for Enter. the
+machine gets one line at a time, when it has gone idle waiting for a key,
+so programs that check the keyboard while running do not eat the script.
+A workload ends when the Z80 code asks the emulator to exit, at the
+instruction limit, or when all input has been typed and the machine is
+waiting for more. Console and aux output go to name.log.
+
+Workloads run one after another on this thread, so that their times are
+not disturbed by each other. Results go to stdout as one JSON object per
+workload and line, for scripts that keep track of them.
+*/
+
+#define BENCHBATCH 10000 // instructions run between polls
+
+typedef struct {
+  char name[64],image[256],delta[256];
+  unsigned long long limit;
+  char input[768];
+} WORKLOAD;
+
+static bool parse(const char *line,WORKLOAD *w)
+{
+int n=0;
+char *c;
+  if (line[0]=='#' ||
+    sscanf(line,"%63s %255s %llu %n",w->name,w->image,&w->limit,&n)<3)
+    return false;
+  snprintf(w->input,sizeof(w->input),"%s",line+n);
+  w->input[strcspn(w->input,"\r\n")]=0;
+  w->delta[0]=0;
+  if ((c=strchr(w->image,','))) {
+    *c=0;
+    strcpy(w->delta,c+1);
+  }
+  return true;
+}
+
+// types next line of input, false if there was none left
+static bool typeline(Machine *m,const char **input)
+{
+const char *p=*input;
+  if (!*p)
+    return false;
+  for (;*p && *p!='|';p++)
+    m->console.rxqueue.Push(*p);
+  if (*p=='|') {
+    m->console.rxqueue.Push('\r');
+    p++;
+  }
+  *input=p;
+  return true;
+}
+
+static void run(WORKLOAD *w)
+{
+Machine *m;
+FILE *out;
+char logname[80];
+const char *input=w->input;
+struct timespec started,t;
+unsigned long long instructions=0;
+double seconds;
+uint32_t sectors;
+const char *result="done";
+#ifdef INSTRUCTIONCOUNTER
+instructioncounter_t before=profilecounter;
+#endif
+  snprintf(logname,sizeof(logname),"%s.log",w->name);
+  out=fopen(logname,"wb");
+  if (!out)
+    perror(logname);
+  m=new Machine(w->image);
+  if (w->delta[0])
+    m->sdcard.SetOverlay(w->delta);
+  m->console.outfile=out;
+  m->aux.outfile=out;
+  clock_gettime(CLOCK_MONOTONIC,&started);
+  m->boot(true,false);
+  for (;;) {
+    uint16_t n=BENCHBATCH;
+    if (w->limit && w->limit-instructions<n)
+      n=w->limit-instructions;
+    m->cpu.step(n);
+    m->poll();
+    #ifdef INSTRUCTIONCOUNTER
+    instructions=profilecounter-before;
+    #else
+    instructions+=n;
+    #endif
+    if (m->finished) {
+      result="exited";
+      break;
+    }
+    if (w->limit && instructions>=w->limit) {
+      result="limit";
+      break;
+    }
+    if (m->idle() && !m->console.rxready() && !typeline(m,&input))
+      break;
+  }
+  m->sdwait();
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  seconds=(t.tv_sec-started.tv_sec)+(t.tv_nsec-started.tv_nsec)/1e9;
+  sectors=m->sectorsread+m->sectorswritten;
+  printf("{\"name\":\"%s\",\"result\":\"%s\",\"seconds\":%.3f,"
+    "\"instructions\":%llu,\"ips\":%.0f,\"ns_per_instruction\":%.2f,"
+    "\"sectors_read\":%u,\"sectors_written\":%u,\"sectors_per_second\":%.0f",
+    w->name,result,seconds,instructions,instructions/seconds,
+    instructions?seconds*1e9/instructions:0.0,
+    m->sectorsread,m->sectorswritten,sectors/seconds);
+  #ifdef CYCLECOUNTER
+  printf(",\"tstates\":%llu",(unsigned long long)m->cpu.cycles);
+  #endif
+  printf("}\n");
+  fflush(stdout);
+  delete m;
+  if (out)
+    fclose(out);
+}
+
+int runbench(const char *suitefile)
+{
+FILE *f=fopen(suitefile,"r");
+char line[1024];
+WORKLOAD w;
+  if (!f) {
+    perror(suitefile);
+    return 1;
+  }
+  while (fgets(line,sizeof(line),f))
+    if (parse(line,&w))
+      run(&w);
+  fclose(f);
+  return 0;
+}
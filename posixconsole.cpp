@@ -43,7 +43,11 @@ bool Console::rxready()
   
 uint8_t Console::receive()
 {
+struct timespec wait={0,1000000L};
+  if (!rxready())
+    flush();
   while (!rxready()) {
+    nanosleep(&wait,NULL);
   }
   // blocks caller until data is received
   return rxqueue.Pop();
@@ -59,10 +63,16 @@ bool Console::txfull()
   return txqueue.IsFull();
 }
 
+// output is left in stdio buffer, machine flushes it on timer tick and
+// when Z80 waits for input
 void Console::send(uint8_t c)  
 {
-  printf("%c",c);
-  fflush(stdout);
+  putc(c,outfile ? outfile : stdout);
+}
+
+void Console::flush()
+{
+  fflush(outfile ? outfile : stdout);
 }
 
 void Console::print(const char *s)
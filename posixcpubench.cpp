@@ -0,0 +1,238 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "z80.hpp"
+
+/*
+CPU only microbenchmarks, make -f Makefile.posix cpubench. This is linked
+with just the Z80 core and console output for its error messages, memory
+is a flat 64K here and I/O reads 0xff and ignores writes, so the numbers
+are for the core alone, whatever dispatch it is built with.
+
+Each benchmark is a loop of one instruction class, the body repeated
+BENCHREPEAT times before jumping back. ns/op is host time per executed
+Z80 instruction, jp at the loop end included. the block moves ones move
+64 bytes per ldir and lddr.
+*/
+
+#define BENCHREPEAT 32
+#define BENCHOPS 20000000UL // default instructions per benchmark
+#define BENCHCODE 0x0100
+#define BENCHSUB 0x7000     // subroutine for the calls, just ret
+
+static uint8_t ram[65536];
+
+uint8_t z80::readram(uint16_t adr)
+{
+  return ram[adr];
+}
+
+void z80::writeram(uint16_t adr,uint8_t data)
+{
+  #ifdef BLOCKCACHE
+  invalidatecode(adr);
+  #endif
+  ram[adr]=data;
+}
+
+uint8_t z80::readio(uint16_t adr)
+{
+  return 0xff;
+}
+
+void z80::writeio(uint16_t adr,uint8_t data)
+{
+}
+
+#ifdef FASTBLOCKOPS
+uint8_t *z80::rampointer(void)
+{
+  return ram;
+}
+
+uint16_t z80::readioblock(uint16_t adr,uint8_t *data,uint16_t n)
+{
+  return 0;
+}
+
+uint16_t z80::writeioblock(uint16_t adr,const uint8_t *data,uint16_t n)
+{
+  return 0;
+}
+#endif
+
+void z80::fault(void)
+{
+}
+
+typedef struct {
+  const char *name;
+  uint8_t n;            // bytes in body
+  uint8_t body[48];
+} BENCH;
+
+static const BENCH benches[] = {
+  { "alu",14,{
+    0x80,                     // add a,b
+    0x91,                     // sub c
+    0xa2,                     // and d
+    0xb3,                     // or e
+    0xac,                     // xor h
+    0xbd,                     // cp l
+    0x3c,                     // inc a
+    0x05,                     // dec b
+    0xc6,0x05,                // add a,5
+    0xee,0x0f,                // xor 0x0f
+    0x8f,                     // adc a,a
+    0x9a } },                 // sbc a,d
+  { "loads",23,{
+    0x7e,                     // ld a,(hl)
+    0x12,                     // ld (de),a
+    0x41,                     // ld b,c
+    0x58,                     // ld e,b
+    0x3e,0x11,                // ld a,0x11
+    0x32,0x00,0x88,           // ld (0x8800),a
+    0x3a,0x00,0x88,           // ld a,(0x8800)
+    0x2a,0x00,0x88,           // ld hl,(0x8800)
+    0x22,0x02,0x88,           // ld (0x8802),hl
+    0x21,0x00,0x80,           // ld hl,0x8000
+    0xc5,                     // push bc
+    0xc1 } },                 // pop bc
+  { "index",28,{
+    0xdd,0x7e,0x01,           // ld a,(ix+1)
+    0xfd,0x77,0x02,           // ld (iy+2),a
+    0xdd,0x86,0x03,           // add a,(ix+3)
+    0xfd,0x34,0x04,           // inc (iy+4)
+    0xdd,0x23,                // inc ix
+    0xdd,0x2b,                // dec ix
+    0xfd,0xe5,                // push iy
+    0xfd,0xe1,                // pop iy
+    0xdd,0xcb,0x06,0x46,      // bit 0,(ix+6)
+    0xfd,0xcb,0x07,0xc6 } },  // set 0,(iy+7)
+  { "bits",20,{
+    0xcb,0x47,                // bit 0,a
+    0xcb,0xc8,                // set 1,b
+    0xcb,0x91,                // res 2,c
+    0xcb,0x12,                // rl d
+    0xcb,0x3b,                // srl e
+    0xcb,0x5e,                // bit 3,(hl)
+    0xcb,0xe6,                // set 4,(hl)
+    0xcb,0x06,                // rlc (hl)
+    0xcb,0x27,                // sla a
+    0xcb,0x18 } },            // rr b
+  { "block",26,{
+    0x21,0x00,0x80,           // ld hl,0x8000
+    0x11,0x00,0x90,           // ld de,0x9000
+    0x01,0x40,0x00,           // ld bc,64
+    0xed,0xb0,                // ldir
+    0x21,0x3f,0x80,           // ld hl,0x803f
+    0x11,0x3f,0x90,           // ld de,0x903f
+    0x01,0x40,0x00,           // ld bc,64
+    0xed,0xb8,                // lddr
+    0xed,0xa0,                // ldi
+    0xed,0xa8 } },            // ldd
+  { "jumps",20,{
+    0xcd,BENCHSUB&0xff,BENCHSUB>>8, // call sub
+    0xff,                     // rst 0x38
+    0x18,0x00,                // jr $+2
+    0x20,0x00,                // jr nz,$+2
+    0x28,0x00,                // jr z,$+2
+    0x10,0x00,                // djnz $+2
+    0xbf,                     // cp a
+    0xc4,BENCHSUB&0xff,BENCHSUB>>8, // call nz,sub
+    0xcc,BENCHSUB&0xff,BENCHSUB>>8, // call z,sub
+    0x00 } },                 // nop
+};
+
+// common setup, then the loop
+static const uint8_t prologue[] = {
+  0x31,0x00,0xf0,             // ld sp,0xf000
+  0x21,0x00,0x80,             // ld hl,0x8000
+  0x11,0x00,0x90,             // ld de,0x9000
+  0xdd,0x21,0x00,0x80,        // ld ix,0x8000
+  0xfd,0x21,0x00,0x81,        // ld iy,0x8100
+  0x01,0x02,0x01              // ld bc,0x0102
+};
+
+static void load(z80 *cpu,const BENCH *b)
+{
+uint16_t a=BENCHCODE,loop;
+  memset(ram,0,sizeof(ram));
+  ram[0x0000]=0xc3;           // jp BENCHCODE
+  ram[0x0001]=BENCHCODE&0xff;
+  ram[0x0002]=BENCHCODE>>8;
+  ram[0x0038]=0xc9;           // ret
+  ram[BENCHSUB]=0xc9;
+  memcpy(&ram[a],prologue,sizeof(prologue));
+  a+=sizeof(prologue);
+  loop=a;
+  for (uint8_t i=0;i<BENCHREPEAT;i++) {
+    memcpy(&ram[a],b->body,b->n);
+    a+=b->n;
+  }
+  ram[a++]=0xc3;              // jp loop
+  ram[a++]=loop&0xff;
+  ram[a++]=loop>>8;
+  cpu->reset();
+}
+
+static double now(void)
+{
+struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+t.tv_nsec/1e9;
+}
+
+int main(int argc,char *argv[])
+{
+z80 *cpu=new z80;
+unsigned long total=argc>1?strtoul(argv[1],NULL,0):BENCHOPS;
+unsigned long left;
+double t;
+  for (uint8_t i=0;i<sizeof(benches)/sizeof(benches[0]);i++) {
+    load(cpu,&benches[i]);
+    cpu->step(10000); // warm up caches and JIT
+    #ifdef CYCLECOUNTER
+    cpu->cycles=0;
+    #endif
+    t=now();
+    for (left=total;left;) {
+      uint16_t n=left>50000?50000:left;
+      cpu->step(n);
+      left-=n;
+    }
+    t=now()-t;
+    printf("%-8s %10lu ops %9.3f s %8.2f ns/op",benches[i].name,total,t,
+      t*1e9/total);
+    #ifdef CYCLECOUNTER
+    printf(" %6.2f T/op %8.1f MHz",(double)cpu->cycles/total,cpu->cycles/t/1e6);
+    #endif
+    printf("\n");
+  }
+  delete cpu;
+  return 0;
+}
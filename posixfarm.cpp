@@ -0,0 +1,296 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "posixmachine.hpp"
+
+/*
+Headless machine farm. Each line of the job file describes one machine:
+
+  image input output [instructions]
+
+image is the SD card image file, input is a file that is typed into the
+console ('-' for none, newlines are sent as CR), output receives everything
+the machine writes to console and aux. A job ends when the Z80 code asks the
+emulator to exit (command 6 to port 0xa0), or after given number of
+instructions if that is specified. Empty lines and lines starting with # are
+skipped. Images are used as they are, nobody is there to answer the offer to
+partition them. image can also be given as base,delta to run on a copy on
+write overlay of base image, so that any number of jobs can share it.
+
+Workers keep their running machines in a deque, taking one from the front,
+running it for a slice and putting it back. A worker that has fewer than
+FARMDEPTH machines starts the next job, and one that has nothing at all
+steals a machine from the back of another worker's deque.
+*/
+
+#define FARMSLICE 100000  // instructions run before switching machines
+#define FARMDEPTH 2       // machines per worker while jobs are left
+#define FARMMAXWORKERS 256
+
+typedef struct {
+  char image[256],delta[256],input[256],output[256];
+  uint64_t limit;
+} JOB;
+
+typedef struct {
+  Machine *machine;
+  JOB *job;
+  FILE *input;
+  uint64_t instructions;
+  struct timespec started;
+} RUNNING;
+
+typedef struct {
+  pthread_mutex_t lock LOCKALIGN;
+  RUNNING *q[FARMDEPTH+1];
+  uint8_t head,count;
+} WORKQUEUE;
+
+static JOB *jobs;
+static int jobcount,nextjob,finishedjobs;
+static int workercount;
+static WORKQUEUE queues[FARMMAXWORKERS];
+static pthread_mutex_t farmlock LOCKALIGN=PTHREAD_MUTEX_INITIALIZER;
+
+static bool push(WORKQUEUE *w,RUNNING *r)
+{
+bool ok=false;
+  pthread_mutex_lock(&w->lock);
+  if (w->count<sizeof(w->q)/sizeof(w->q[0])) {
+    w->q[(w->head+w->count)%(sizeof(w->q)/sizeof(w->q[0]))]=r;
+    w->count++;
+    ok=true;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+// own machines are taken from front, stolen ones from back
+static RUNNING *take(WORKQUEUE *w,bool steal)
+{
+RUNNING *r=NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->count) {
+    w->count--;
+    if (steal)
+      r=w->q[(w->head+w->count)%(sizeof(w->q)/sizeof(w->q[0]))];
+    else {
+      r=w->q[w->head];
+      w->head=(w->head+1)%(sizeof(w->q)/sizeof(w->q[0]));
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return r;
+}
+
+static uint8_t queued(WORKQUEUE *w)
+{
+uint8_t n;
+  pthread_mutex_lock(&w->lock);
+  n=w->count;
+  pthread_mutex_unlock(&w->lock);
+  return n;
+}
+
+// type script into console as long as there is room for it
+static void feedinput(RUNNING *r)
+{
+int c;
+  if (!r->input)
+    return;
+  while (!r->machine->console.rxqueue.IsFull()) {
+    c=fgetc(r->input);
+    if (c==EOF) {
+      fclose(r->input);
+      r->input=NULL;
+      return;
+    }
+    r->machine->console.rxqueue.Push(c=='\n'?'\r':c);
+  }
+}
+
+static RUNNING *startjob(void)
+{
+RUNNING *r;
+JOB *job;
+FILE *out;
+  pthread_mutex_lock(&farmlock);
+  job=nextjob<jobcount?&jobs[nextjob++]:NULL;
+  pthread_mutex_unlock(&farmlock);
+  if (!job)
+    return NULL;
+  r=new RUNNING;
+  r->job=job;
+  r->instructions=0;
+  r->input=strcmp(job->input,"-")?fopen(job->input,"rb"):NULL;
+  out=fopen(job->output,"wb");
+  if (!out)
+    perror(job->output);
+  r->machine=new Machine(job->image);
+  if (job->delta[0])
+    r->machine->sdcard.SetOverlay(job->delta);
+  r->machine->console.outfile=out;
+  r->machine->aux.outfile=out;
+  clock_gettime(CLOCK_MONOTONIC,&r->started);
+  r->machine->boot(true,false);
+  return r;
+}
+
+static void endjob(RUNNING *r)
+{
+struct timespec t;
+double seconds;
+FILE *out;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  seconds=(t.tv_sec-r->started.tv_sec)+(t.tv_nsec-r->started.tv_nsec)/1e9;
+  out=r->machine->console.outfile;
+  if (r->input)
+    fclose(r->input);
+  pthread_mutex_lock(&farmlock);
+  finishedjobs++;
+  printf("%s: %s, %llu instructions in %.2f s\n",r->job->image,
+    r->machine->finished?"exited":"instruction limit",
+    (unsigned long long)r->instructions,seconds);
+  fflush(stdout);
+  pthread_mutex_unlock(&farmlock);
+  delete r->machine; // flushes its output, so the file is closed after
+  if (out)
+    fclose(out);
+  delete r;
+}
+
+static bool alldone(void)
+{
+bool done;
+  pthread_mutex_lock(&farmlock);
+  done=finishedjobs==jobcount;
+  pthread_mutex_unlock(&farmlock);
+  return done;
+}
+
+static void *worker(void *arg)
+{
+int self=(int)(intptr_t)arg;
+RUNNING *r;
+uint32_t slice;
+instructioncounter_t before=0;
+  while (!alldone()) {
+    r=NULL;
+    if (queued(&queues[self])<FARMDEPTH)
+      r=startjob();
+    if (!r)
+      r=take(&queues[self],false);
+    for (int i=1;!r && i<workercount;i++)
+      r=take(&queues[(self+i)%workercount],true);
+    if (!r) {
+      usleep(1000);
+      continue;
+    }
+    slice=FARMSLICE;
+    if (r->job->limit && r->job->limit-r->instructions<slice)
+      slice=r->job->limit-r->instructions;
+    feedinput(r);
+    #ifdef INSTRUCTIONCOUNTER
+    before=profilecounter;
+    #endif
+    while (slice && !r->machine->finished) {
+      uint16_t n=slice>10000?10000:slice;
+      r->machine->cpu.step(n);
+      r->machine->poll();
+      slice-=n;
+      #ifndef INSTRUCTIONCOUNTER
+      r->instructions+=n;
+      #endif
+    }
+    #ifdef INSTRUCTIONCOUNTER
+    r->instructions+=profilecounter-before;
+    #endif
+    if (r->machine->finished || (r->job->limit && r->instructions>=r->job->limit))
+      endjob(r);
+    else
+      push(&queues[self],r);
+  }
+  return NULL;
+}
+
+static int readjobs(const char *jobfile)
+{
+FILE *f=fopen(jobfile,"r");
+char line[1024];
+int n=0,allocated=0;
+JOB job;
+unsigned long long limit;
+char *c;
+  if (!f) {
+    perror(jobfile);
+    return -1;
+  }
+  while (fgets(line,sizeof(line),f)) {
+    if (line[0]=='#')
+      continue;
+    limit=0;
+    if (sscanf(line,"%255s %255s %255s %llu",job.image,job.input,job.output,&limit)<3)
+      continue;
+    job.limit=limit;
+    job.delta[0]=0;
+    if ((c=strchr(job.image,','))) {
+      *c=0;
+      strcpy(job.delta,c+1);
+    }
+    if (n==allocated) {
+      allocated=allocated?allocated*2:64;
+      jobs=(JOB*)realloc(jobs,allocated*sizeof(JOB));
+    }
+    jobs[n++]=job;
+  }
+  fclose(f);
+  return n;
+}
+
+int runfarm(int workers,const char *jobfile)
+{
+pthread_t threads[FARMMAXWORKERS];
+  jobcount=readjobs(jobfile);
+  if (jobcount<0)
+    return 1;
+  if (workers<=0)
+    workers=sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers>FARMMAXWORKERS)
+    workers=FARMMAXWORKERS;
+  if (workers>jobcount)
+    workers=jobcount?jobcount:1;
+  workercount=workers;
+  for (int i=0;i<workers;i++)
+    pthread_mutex_init(&queues[i].lock,NULL);
+  for (int i=0;i<workers;i++)
+    pthread_create(&threads[i],NULL,worker,(void*)(intptr_t)i);
+  for (int i=0;i<workers;i++)
+    pthread_join(threads[i],NULL);
+  return 0;
+}
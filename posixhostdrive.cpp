@@ -0,0 +1,454 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "posixhostdrive.hpp"
+
+// FCB fields
+#define FCB_DR 0
+#define FCB_NAME 1
+#define FCB_EX 12
+#define FCB_S2 14
+#define FCB_RC 15
+#define FCB_NEWNAME 17
+#define FCB_CR 32
+#define FCB_R0 33
+#define FCB_R2 35
+#define FCBSIZE 36
+
+HostDrive::HostDrive(uint8_t *ram,const char *dir,uint8_t drive) :
+  drive(drive&15),curdrive(0),dma(0x80),nextfile(0),listing(NULL),ram(ram)
+{
+  snprintf(this->dir,sizeof(this->dir),"%s",dir);
+  memset(files,0,sizeof(files));
+  memset(pattern,0,sizeof(pattern));
+}
+
+HostDrive::~HostDrive()
+{
+  for (uint8_t i=0;i<HOSTFILES;i++)
+    if (files[i].f)
+      fclose(files[i].f);
+  if (listing)
+    closedir(listing);
+}
+
+// true if FCB at given address is for this drive
+bool HostDrive::fcbdrive(uint16_t fcb)
+{
+uint8_t d;
+  if (fcb>0x10000-FCBSIZE)
+    return false;
+  d=ram[fcb+FCB_DR];
+  if (d==0 || d=='?')
+    return curdrive==drive;
+  return ((d-1)&15)==drive;
+}
+
+// CP/M name of host file, false if the name does not fit 8.3
+static bool cpmname(const char *host,uint8_t *name)
+{
+const char *dot;
+int i,n;
+  if (host[0]=='.')
+    return false;
+  dot=strrchr(host,'.');
+  if (dot && strchr(host,'.')!=dot) // only one dot, before the type
+    return false;
+  n=dot ? dot-host : strlen(host);
+  if (n<1 || n>8 || (dot && strlen(dot+1)>3))
+    return false;
+  memset(name,' ',11);
+  for (i=0;host[i];i++) {
+    if (!isgraph((unsigned char)host[i]) || strchr("<>,;:=?*[]",host[i]))
+      return false;
+    if (i<n)
+      name[i]=toupper((unsigned char)host[i]);
+    else if (i>n)
+      name[8+i-n-1]=toupper((unsigned char)host[i]);
+  }
+  return true;
+}
+
+// true if CP/M name can be made into a host file name, so no wildcards
+// and nothing that would reach outside of the directory
+static bool validname(const uint8_t *name)
+{
+uint8_t c;
+  if ((name[0]&0x7f)==' ')
+    return false;
+  for (uint8_t i=0;i<11;i++) {
+    c=name[i]&0x7f;
+    if (c==' ') { // padding, only at the end of name or type
+      if (i!=7 && i!=10 && (name[i+1]&0x7f)!=' ')
+        return false;
+      continue;
+    }
+    if (!isgraph(c) || strchr("<>,;:=?*[]/\\.",c))
+      return false;
+  }
+  return true;
+}
+
+static bool namematch(const uint8_t *pat,const uint8_t *name)
+{
+uint8_t p;
+  for (uint8_t i=0;i<11;i++) {
+    p=toupper(pat[i]&0x7f); // high bits are attributes
+    if (p!='?' && p!=name[i])
+      return false;
+  }
+  return true;
+}
+
+// next regular file in listing that matches pattern, name can be the
+// same buffer as pattern
+bool HostDrive::nextname(DIR *d,const uint8_t *pat,uint8_t *name,char *path)
+{
+struct dirent *e;
+struct stat st;
+uint8_t n[11];
+  while ((e=readdir(d))) {
+    if (!cpmname(e->d_name,n) || !namematch(pat,n))
+      continue;
+    snprintf(path,512,"%s/%s",dir,e->d_name);
+    if (!stat(path,&st) && S_ISREG(st.st_mode)) {
+      memcpy(name,n,11);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HostDrive::findname(const uint8_t *pat,uint8_t *name,char *path)
+{
+DIR *d;
+bool found;
+  d=opendir(dir);
+  if (!d)
+    return false;
+  found=nextname(d,pat,name,path);
+  closedir(d);
+  return found;
+}
+
+// host path for a new file, name in lower case
+void HostDrive::makepath(const uint8_t *name,char *path)
+{
+char s[13];
+int n=0;
+  for (uint8_t i=0;i<11;i++) {
+    if (i==8)
+      s[n++]='.';
+    if ((name[i]&0x7f)!=' ')
+      s[n++]=tolower(name[i]&0x7f);
+  }
+  if (s[n-1]=='.')
+    n--;
+  s[n]=0;
+  snprintf(path,512,"%s/%s",dir,s);
+}
+
+// host file for CP/M name, kept open for following calls. create does not
+// touch a file that is already there, like make on a real disk
+FILE *HostDrive::openfile(const uint8_t *name,bool create)
+{
+uint8_t n[11];
+char path[512];
+FILE *f;
+uint8_t i;
+  for (i=0;i<11;i++)
+    n[i]=toupper(name[i]&0x7f);
+  for (i=0;i<HOSTFILES;i++)
+    if (files[i].f && !memcmp(files[i].name,n,11))
+      break;
+  if (create) {
+    if (!validname(n))
+      return NULL;
+    if (i<HOSTFILES) {
+      fclose(files[i].f);
+      files[i].f=NULL;
+    }
+    if (findname(n,n,path))
+      return NULL;
+    makepath(n,path);
+    f=fopen(path,"w+b");
+  }
+  else {
+    if (i<HOSTFILES)
+      return files[i].f;
+    if (!findname(n,n,path))
+      return NULL;
+    f=fopen(path,"r+b");
+    if (!f)
+      f=fopen(path,"rb");
+  }
+  if (!f)
+    return NULL;
+  i=nextfile;
+  nextfile=(nextfile+1)%HOSTFILES;
+  if (files[i].f)
+    fclose(files[i].f);
+  memcpy(files[i].name,n,11);
+  files[i].f=f;
+  return f;
+}
+
+// forgets open files matching the name before they are removed or renamed
+void HostDrive::closefile(const uint8_t *name)
+{
+  for (uint8_t i=0;i<HOSTFILES;i++)
+    if (files[i].f && namematch(name,files[i].name)) {
+      fclose(files[i].f);
+      files[i].f=NULL;
+    }
+}
+
+// extent and record count fields for file size, as directory would have
+static void setextent(uint8_t *p,uint32_t records)
+{
+uint32_t e=records ? (records-1)>>7 : 0;
+  p[FCB_EX]=e&31;
+  p[FCB_S2]=e>>5;
+  p[FCB_RC]=records-(e<<7);
+}
+
+static uint32_t filerecords(FILE *f)
+{
+struct stat st;
+  if (fstat(fileno(f),&st))
+    return 0;
+  return (st.st_size+127)>>7;
+}
+
+// moves a record between host file and DMA, sets FCB to point at it.
+// returns BDOS status, 0 for success, 1 for reading past end of file
+uint8_t HostDrive::transfer(uint8_t *fcb,uint32_t record,bool write)
+{
+FILE *f;
+uint8_t buf[128],*p;
+uint32_t records;
+size_t n;
+  f=openfile(fcb+FCB_NAME,false);
+  if (!f)
+    return write ? 2 : 1;
+  fcb[FCB_CR]=record&127;
+  fcb[FCB_EX]=(record>>7)&31;
+  fcb[FCB_S2]=record>>12;
+  // straight to Z80 RAM unless DMA buffer wraps around the end
+  p=dma<=0x10000-128 ? ram+dma : buf;
+  if (fseek(f,(long)record*128,SEEK_SET))
+    return write ? 2 : 1;
+  if (write) {
+    if (p==buf)
+      for (n=0;n<128;n++)
+        buf[n]=ram[(dma+n)&0xffff];
+    if (fwrite(p,1,128,f)!=128)
+      return 2;
+  }
+  else {
+    n=fread(p,1,128,f);
+    if (!n)
+      return 1;
+    memset(p+n,0x1a,128-n); // ^Z padding after end of file
+    if (p==buf)
+      for (n=0;n<128;n++)
+        ram[(dma+n)&0xffff]=buf[n];
+  }
+  records=filerecords(f)-((record>>7)<<7);
+  fcb[FCB_RC]=records>128 ? 128 : records;
+  return 0;
+}
+
+// directory entry for next match to DMA
+uint8_t HostDrive::search(void)
+{
+uint8_t entry[32];
+char path[512];
+FILE *f;
+uint32_t records=0;
+  if (!listing || !nextname(listing,pattern,entry+1,path)) {
+    if (listing)
+      closedir(listing);
+    listing=NULL;
+    return 0xff;
+  }
+  f=fopen(path,"rb");
+  if (f) {
+    records=filerecords(f);
+    fclose(f);
+  }
+  memset(entry+12,0,20);
+  entry[0]=0; // user number
+  setextent(entry,records);
+  for (uint8_t i=0;i<32;i++)
+    ram[(dma+i)&0xffff]=entry[i];
+  return 0;
+}
+
+uint8_t HostDrive::remove(const uint8_t *fcb)
+{
+uint8_t name[11];
+char path[512];
+DIR *d;
+uint8_t r=0xff;
+  closefile(fcb+FCB_NAME);
+  d=opendir(dir);
+  if (!d)
+    return r;
+  while (nextname(d,fcb+FCB_NAME,name,path))
+    if (!unlink(path))
+      r=0;
+  closedir(d);
+  return r;
+}
+
+uint8_t HostDrive::rename(const uint8_t *fcb)
+{
+uint8_t name[11],newname[11];
+char path[512],newpath[512];
+  for (uint8_t i=0;i<11;i++)
+    newname[i]=toupper(fcb[FCB_NEWNAME+i]&0x7f);
+  if (!validname(fcb+FCB_NAME) || !validname(newname))
+    return 0xff;
+  closefile(fcb+FCB_NAME);
+  if (!findname(fcb+FCB_NAME,name,path))
+    return 0xff;
+  closefile(newname);
+  if (!findname(newname,newname,newpath))
+    makepath(newname,newpath);
+  return ::rename(path,newpath) ? 0xff : 0;
+}
+
+// serves BDOS function with parameter de if it is for this drive, and
+// returns true with BDOS result in HL. false lets the BDOS do it
+bool HostDrive::bdos(uint8_t function,uint16_t de,uint16_t *result)
+{
+uint8_t *fcb=ram+de;
+uint32_t records;
+char path[512];
+FILE *f;
+  *result=0;
+  switch (function) {
+    case 13: // reset disk system
+      curdrive=0;
+      dma=0x80;
+      closefile((const uint8_t*)"???????????");
+      return false;
+    case 14: // select disk
+      curdrive=de&15;
+      return false;
+    case 26: // set DMA address
+      dma=de;
+      return false;
+    case 18: // search next, goes where search first went
+      if (!listing)
+        return false;
+      *result=search();
+      return true;
+  }
+  if (function==17 && listing) { // search first, anywhere
+    closedir(listing);
+    listing=NULL;
+  }
+  if (!fcbdrive(de))
+    return false;
+  switch (function) {
+    case 15: // open file
+      f=openfile(fcb+FCB_NAME,false);
+      if (!f) {
+        *result=0xff;
+        break;
+      }
+      // names with wildcards get the one that was found
+      findname(fcb+FCB_NAME,fcb+FCB_NAME,path);
+      // extents past the end are not in the directory, only an empty
+      // file has an empty one. S2 stays, it is the module opened
+      records=filerecords(f)-((fcb[FCB_EX]&31)<<7)-((fcb[FCB_S2]&0x3f)<<12);
+      if ((int32_t)records<=0 && ((fcb[FCB_EX]&31) || (fcb[FCB_S2]&0x3f))) {
+        *result=0xff;
+        break;
+      }
+      fcb[FCB_RC]=(int32_t)records<0 ? 0 : records>128 ? 128 : records;
+      break;
+    case 16: // close file
+      f=openfile(fcb+FCB_NAME,false);
+      if (f)
+        fflush(f);
+      *result=f ? 0 : 0xff;
+      break;
+    case 17: // search first
+      memcpy(pattern,fcb+FCB_NAME,11);
+      listing=opendir(dir);
+      *result=search();
+      break;
+    case 19: // delete file
+      *result=remove(fcb);
+      break;
+    case 20: // read sequential
+    case 21: // write sequential
+      records=((fcb[FCB_S2]&0x3f)<<12)|((fcb[FCB_EX]&31)<<7)|(fcb[FCB_CR]&127);
+      *result=transfer(fcb,records,function==21);
+      if (!*result)
+        records++;
+      fcb[FCB_CR]=records&127;
+      fcb[FCB_EX]=(records>>7)&31;
+      fcb[FCB_S2]=records>>12;
+      break;
+    case 22: // make file, fails if it exists
+      f=openfile(fcb+FCB_NAME,true);
+      fcb[FCB_RC]=0;
+      *result=f ? 0 : 0xff;
+      break;
+    case 23: // rename file
+      *result=rename(fcb);
+      break;
+    case 30: // set file attributes, host files have none
+      *result=0;
+      break;
+    case 33: // read random
+    case 34: // write random
+    case 40: // write random with zero fill, host fills holes with zeros
+      if (fcb[FCB_R2]) {
+        *result=6; // seek past end of disk
+        break;
+      }
+      *result=transfer(fcb,fcb[FCB_R0]|(fcb[FCB_R0+1]<<8),function!=33);
+      break;
+    case 35: // compute file size
+      f=openfile(fcb+FCB_NAME,false);
+      records=f ? filerecords(f) : 0;
+      fcb[FCB_R0]=records;
+      fcb[FCB_R0+1]=records>>8;
+      fcb[FCB_R2]=records>>16;
+      *result=f ? 0 : 0xff;
+      break;
+    default: // rest only look at FCB or BDOS state
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,75 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __posixhostdrive_hpp__
+#define __posixhostdrive_hpp__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <dirent.h>
+
+// host files kept open between BDOS calls
+#define HOSTFILES 8
+
+/*
+CP/M drive that is a directory on host. BIOS hooks the BDOS entry and
+hands disk functions to the machine, which serves those naming this drive
+from host files and lets the rest go on to the BDOS. files whose names fit
+8.3 are visible as upper case CP/M names, records are read and written
+straight between the host file and DMA address in Z80 RAM
+*/
+class HostDrive
+{
+  typedef struct {
+    uint8_t name[11];  // CP/M name, blank padded
+    FILE *f;
+  } HOSTFILE;
+
+  char dir[256];
+  uint8_t drive;       // 0 for A: ... 15 for P:
+  uint8_t curdrive;    // BDOS current drive, followed from function 14
+  uint16_t dma;        // BDOS DMA address, followed from function 26
+  HOSTFILE files[HOSTFILES];
+  uint8_t nextfile;    // slot to reuse when all are taken
+  DIR *listing;        // directory being searched, for search next
+  uint8_t pattern[11]; // name being searched for
+  uint8_t *ram;
+
+  bool fcbdrive(uint16_t fcb);
+  bool nextname(DIR *d,const uint8_t *pat,uint8_t *name,char *path);
+  bool findname(const uint8_t *pat,uint8_t *name,char *path);
+  void makepath(const uint8_t *name,char *path);
+  FILE *openfile(const uint8_t *name,bool create);
+  void closefile(const uint8_t *name);
+  uint8_t transfer(uint8_t *fcb,uint32_t record,bool write);
+  uint8_t search(void);
+  uint8_t remove(const uint8_t *fcb);
+  uint8_t rename(const uint8_t *fcb);
+
+public:
+  HostDrive(uint8_t *ram,const char *dir,uint8_t drive);
+  ~HostDrive();
+  bool bdos(uint8_t function,uint16_t de,uint16_t *result);
+  uint16_t dmaaddress(void) { return dma; }
+};
+
+#endif
@@ -20,13 +20,14 @@
   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
   SOFTWARE.
 */
-#include "machine.hpp"
-#include "sdcard.hpp"
+#include "posixmachine.hpp"
+#include "partitioner.hpp"
 
 /*
 this module implements the physical machine around z80 emulator, providing access
-to RAM and I/O space, and implementing some of the I/O using AVR hardware - 
-serial ports, SD card inteface, and timer.
+to RAM and I/O space, and implementing the I/O devices on top of host terminal
+and files. all machine state lives in Machine, z80 finds its own through
+cpu.machine
 */
 
 #include <signal.h>
@@ -38,25 +39,27 @@ serial ports, SD card inteface, and timer.
 #include <pthread.h>
 #endif
 
-enum MSTATE { IDLE, BIOS, CPM, TIMECOUNTER };
+#define SDIDLE 0xff
 
-static uint32_t timecounter,timecountersnapshot; // counts 10ms ticks
-static uint8_t auxbaud;
-static uint8_t sd0,sd1,sd2,sd3,sds;
-static uint8_t sdc;
-static uint16_t dataofs;
-static MSTATE state;
-static uint16_t count;
+// what the core collects besides pccounts for the profiler report
+#if defined(CYCLECOUNTER) && defined(CALLPROFILER)
+#define PROFILECYCLES cpu.pccycles,cpu.sitecycles,cpu.sitecalls
+#elif defined(CYCLECOUNTER)
+#define PROFILECYCLES cpu.pccycles
+#else
+#define PROFILECYCLES NULL
+#endif
 
 static uint16_t baudrates[8]= {
  50, 300,1200,2400,4800,9600,19200,38400 
 };
 
-uint8_t ramspace[65536L];
-uint8_t iospace[256];
-
-static uint8_t io_read(uint16_t adr);
-static void io_write(uint16_t adr,uint8_t b);
+// the machine that host terminal is connected to, input thread only uses
+// it under inputlock so that release_terminal() can take it away
+static Machine *volatile terminal;
+#if __linux__
+static timer_t ticktimer;
+#endif
 
 struct termios orig_termios;
 
@@ -80,35 +83,62 @@ void set_conio_terminal_mode()
     tcsetattr(0, TCSANOW, &new_termios);
 }
 
-int kbhit()
+// idle machine sleeps on this until input thread has something for it
+static pthread_mutex_t inputlock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inputcond=PTHREAD_COND_INITIALIZER;
+
+// timer ticks are taken by main thread only, the machine is deleted there
+static void blocktimer(void)
 {
-    struct timeval tv = { 0L, 0L };
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    return select(1, &fds, NULL, NULL, &tv)>0;
+sigset_t s;
+  sigemptyset(&s);
+  sigaddset(&s,SIGALRM);
+  pthread_sigmask(SIG_BLOCK,&s,NULL);
 }
 
-
-int getch()
+// feeds host terminal keys to console as soon as they arrive, so that
+// typing and pasting is not paced by timer ticks. waits while the console
+// input ring is full
+static void *inputthread(void *arg)
 {
-    int r;
-    unsigned char c;
-    if ((r = read(0, &c, sizeof(c))) < 0) {
-        return r;
-    } else {
-      if (c==0x7f)
-        c=8;
-      return c;
+uint8_t buf[256];
+struct timespec wait={0,1000000L};
+ssize_t i,n;
+bool pushed;
+  blocktimer();
+  while ((n=read(0,buf,sizeof(buf)))>0) {
+    for (i=0;i<n;i++) {
+      if (buf[i]==0x7f)
+        buf[i]=8;
+      for (;;) { // keys are dropped once there is no terminal machine
+        pthread_mutex_lock(&inputlock);
+        pushed=!terminal || terminal->console.rxqueue.Push(buf[i]);
+        pthread_mutex_unlock(&inputlock);
+        if (pushed)
+          break;
+        nanosleep(&wait,NULL);
+      }
     }
+    pthread_mutex_lock(&inputlock);
+    pthread_cond_broadcast(&inputcond);
+    pthread_mutex_unlock(&inputlock);
+  }
+  return NULL;
 }
 
 static void timerhandler(int sig,siginfo_t *si,void *ucontext)
 {
-  timecounter++;
-  console.tick();
-  if (kbhit())
-    console.rxqueue.Push(getch());
+Machine *m=terminal;
+  if (m)
+    m->console.tick();
+}
+
+// host monotonic clock in 10ms ticks, machines count their time from this
+static uint32_t hostticks(void)
+{
+struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (uint32_t)t.tv_sec*100+t.tv_nsec/10000000L;
 }
 
 
@@ -121,43 +151,61 @@ struct timespec sleeptime;
   sleeptime.tv_nsec=10000000L;
   while (1) {
     nanosleep(&sleeptime,NULL);
+    pthread_mutex_lock(&inputlock);
     timerhandler(0,NULL,NULL);
+    pthread_mutex_unlock(&inputlock);
   }
 }
 
 #endif
 
-void initialize_machine(void)
+void initialize_terminal(Machine *m)
 {
 #if __linux__
-timer_t t;
 struct itimerspec timerinterval;
 struct sigaction action;
 struct sigevent sev;
   action.sa_sigaction=timerhandler;
   sigemptyset(&action.sa_mask);
-  action.sa_flags=SA_SIGINFO;
+  action.sa_flags=SA_SIGINFO|SA_RESTART; // ticks must not break output writes
   if (sigaction(SIGALRM,&action,NULL)) {
     perror("sigaction");
     return;
   }
   sev.sigev_notify=SIGEV_SIGNAL;
   sev.sigev_signo=SIGALRM;
-  sev.sigev_value.sival_ptr=&t;
-  if (!timer_create(CLOCK_MONOTONIC,&sev,&t)) {
+  sev.sigev_value.sival_ptr=&ticktimer;
+  if (!timer_create(CLOCK_MONOTONIC,&sev,&ticktimer)) {
    // 10 ms intervals, starting 10 ms from now
     timerinterval.it_value.tv_sec=0;
     timerinterval.it_value.tv_nsec=10000000L;
     timerinterval.it_interval.tv_sec=0;
     timerinterval.it_interval.tv_nsec=10000000L;
-    if (timer_settime(t,0,&timerinterval,NULL))
+    if (timer_settime(ticktimer,0,&timerinterval,NULL))
       perror("timer_create");
   }
 #else
 pthread_t thread;
   pthread_create(&thread,NULL,timer_thread,NULL);
 #endif
+pthread_t input;
+  terminal=m;
+  setvbuf(stdout,NULL,_IOFBF,CONSOLEBUFFER);
   set_conio_terminal_mode();
+  if (!pthread_create(&input,NULL,inputthread,NULL))
+    pthread_detach(input);
+}
+
+// stops ticks and keys going to the terminal machine, so that it can be
+// deleted. the input thread stays blocked in read() until exit
+void release_terminal(void)
+{
+  #if __linux__
+  timer_delete(ticktimer);
+  #endif
+  pthread_mutex_lock(&inputlock);
+  terminal=NULL;
+  pthread_mutex_unlock(&inputlock);
 }
 
 // read one byte of data from memory address
@@ -165,7 +213,7 @@ pthread_t thread;
 // needs to be applied here
 uint8_t z80::readram(uint16_t adr)
 {
-  return ramspace[adr];
+  return machine->ram[adr];
 }
 
 // write one byte of data to memory address
@@ -173,7 +221,10 @@ uint8_t z80::readram(uint16_t adr)
 // needs to be applied here
 void z80::writeram(uint16_t adr,uint8_t data)
 {
-  ramspace[adr]=data;
+  #ifdef BLOCKCACHE
+  invalidatecode(adr);
+  #endif
+  machine->ram[adr]=data;
 }
 
 // read data from I/O space.
@@ -182,8 +233,8 @@ void z80::writeram(uint16_t adr,uint8_t data)
 uint8_t z80::readio(uint16_t adr)
 {
   if (adr>=0xa0)
-    return io_read(adr);
-  return iospace[adr];
+    return machine->io_read(adr);
+  return machine->iospace[adr];
 }
 
 // write data to I/O space.
@@ -192,21 +243,176 @@ uint8_t z80::readio(uint16_t adr)
 void z80::writeio(uint16_t adr,uint8_t data)
 { 
   if (adr>=0xa0)
-    io_write(adr,data);
+    machine->io_write(adr,data);
   else
-    iospace[adr]=data;
+    machine->iospace[adr]=data;
+}
+
+#ifdef FASTBLOCKOPS
+// RAM for the block instructions to work on directly
+uint8_t *z80::rampointer(void)
+{
+  return machine->ram;
 }
 
+// bulk transfers for inir/otir, only SD card data port supports these
+uint16_t z80::readioblock(uint16_t adr,uint8_t *data,uint16_t n)
+{
+  return machine->io_readblock(adr,data,n);
+}
+
+uint16_t z80::writeioblock(uint16_t adr,const uint8_t *data,uint16_t n)
+{
+  return machine->io_writeblock(adr,data,n);
+}
+#endif
+
 // this is called when invalid instruction is encountered
 void z80::fault(void)
 {
-  console.print("\r\n");
+  machine->console.print("\r\n");
   //console.print("Z80 emulator fault. PC=");
   //console.phex(pcreg>>8);
   //console.phex(pcreg&255);
 }
 
-void copy_bootloader(void)
+Machine::Machine(const char *imagefile) :
+  timebase(hostticks()),timecountersnapshot(0),auxbaud(0),
+  sd0(0),sd1(0),sd2(0),sd3(0),sds(0),sdc(0),dataofs(0),sda(0),sdn(0),
+  dmastart(0),dmalength(0),sdinflight(false),sdpending(SDIDLE),synctime(0),
+  flushtime(0),conspolls(0),idlepolls(0),
+  state(IDLE),count(0),hostpb(0)
+{
+  sdbuf=sdcard.GetBuf();
+  #ifdef ASYNCSD
+  sdthreadstarted=false;
+  sdquit=false;
+  pthread_mutex_init(&sdlock,NULL);
+  pthread_cond_init(&sdcond,NULL);
+  #endif
+  finished=false;
+  hostdrive=NULL;
+  profiler=NULL;
+  sectorsread=0;
+  sectorswritten=0;
+  cpu.machine=this;
+  #ifdef CYCLECOUNTER
+  cpu.cycles=0;
+  cyclebase=0;
+  cyclesnapshot=0;
+  #endif
+  console.outfile=NULL;
+  aux.outfile=NULL;
+  sdcard.SetImageFile(imagefile);
+  memset(ram,0,sizeof(ram));
+  memset(iospace,0,sizeof(iospace));
+}
+
+Machine::~Machine()
+{
+  console.flush();
+  aux.flush();
+  sdwait();
+  #ifdef ASYNCSD
+  if (sdthreadstarted) {
+    pthread_mutex_lock(&sdlock);
+    sdquit=true;
+    pthread_cond_broadcast(&sdcond);
+    pthread_mutex_unlock(&sdlock);
+    pthread_join(sdthread,NULL);
+  }
+  pthread_cond_destroy(&sdcond);
+  pthread_mutex_destroy(&sdlock);
+  #endif
+  delete hostdrive;
+  #ifdef PCPROFILER
+  if (profiler)
+    profiler->report(cpu.pccounts,PROFILECYCLES);
+  #endif
+  #ifdef CALLPROFILER
+  if (profiler)
+    profiler->folded();
+  #endif
+  delete profiler;
+}
+
+uint32_t Machine::timecounter(void)
+{
+  return hostticks()-timebase;
+}
+
+// to be called between instruction batches, writes out console output
+// and takes call stack profile sample once per tick, and syncs SD card image file if it has been written to
+// and last sync was long enough ago
+void Machine::poll(void)
+{
+uint32_t t;
+  t=hostticks();
+  if (t!=flushtime) {
+    console.flush();
+    aux.flush();
+    flushtime=t;
+    #ifdef CALLPROFILER
+    if (profiler) {
+      uint16_t frames[CALLSTACKDEPTH+1];
+      profiler->sample(frames,cpu.backtrace(frames));
+    }
+    #endif
+  }
+  if (!sdidle() || !sdcard.Dirty())
+    return;
+  if (t-synctime>=SDSYNCTICKS) {
+    sdcard.Flush();
+    synctime=t;
+  }
+}
+
+// to be called between instruction batches, true if Z80 spent the last
+// one waiting for console input or executed halt
+bool Machine::idle(void)
+{
+bool waiting=idlepolls>=IDLEPOLLS;
+  idlepolls=0;
+  return cpu.washalted() || waiting;
+}
+
+// blocks until there is console input or next host tick, so that an idle
+// machine does not keep a host core busy
+void Machine::sleep(void)
+{
+struct timespec t;
+  clock_gettime(CLOCK_REALTIME,&t);
+  t.tv_nsec+=10000000L;
+  if (t.tv_nsec>=1000000000L) {
+    t.tv_sec++;
+    t.tv_nsec-=1000000000L;
+  }
+  pthread_mutex_lock(&inputlock);
+  if (!console.rxready())
+    pthread_cond_timedwait(&inputcond,&inputlock,&t);
+  pthread_mutex_unlock(&inputlock);
+}
+
+// what the AVR machine does after power on, initialize the card and
+// check its partitions, then start from bootstrap loader. the check asks
+// on console whether to partition the card if it is not
+void Machine::boot(bool initcard,bool checkcard)
+{
+  sdwait();
+  if (initcard) {
+    sdcard.Init();
+    sdbuf=sdcard.GetBuf();
+  }
+  console.init();
+  aux.init();
+  console.print("\ec\x0f\e[H\e[2JZ80 emulator for 1.0\r\n");
+  if (checkcard)
+    checkdisk(sdcard,console);
+  copy_bootloader();
+  cpu.reset();
+}
+
+void Machine::copy_bootloader(void)
 {
 uint16_t a;
 uint8_t b;
@@ -217,9 +423,11 @@ uint8_t b;
   }  
 }
 
-static uint8_t io_read(uint16_t adr)
+uint8_t Machine::io_read(uint16_t adr)
 {
 uint8_t b=0;
+  if (adr>=0xa6 && adr!=0xa8) // SD card registers are busy until completion
+    sdwait();
   switch (adr) {
 
     // misc operations data read
@@ -247,6 +455,20 @@ uint8_t b=0;
           b=timecountersnapshot&255;
           timecountersnapshot>>=8;
           break;
+        case HOSTQUERY:
+          b=hostdrive ? 1 : 0;
+          state=IDLE;
+          break;
+        case HOSTCALL:
+          b=hostcall();
+          state=IDLE;
+          break;
+        #ifdef CYCLECOUNTER
+        case TSTATES:
+          b=cyclesnapshot&255;
+          cyclesnapshot>>=8;
+          break;
+        #endif
         default:
           state=IDLE;
           break;
@@ -263,6 +485,18 @@ uint8_t b=0;
     case 0xa3: // console status
       b=console.rxready()?1:0;
       b|=console.txfull()?2:0;
+      // BIOS checks status before each character it sends, only polling
+      // again without sending means that it is waiting for input
+      if (b) {
+        conspolls=0;
+        idlepolls=0;
+        break;
+      }
+      if (conspolls<255 && ++conspolls==2) {
+        console.flush();
+        aux.flush();
+      }
+      idlepolls++;
       break;
     
     // aux input/status
@@ -280,11 +514,12 @@ uint8_t b=0;
     // sd card status/read
     
     case 0xa8: // A_SDC - read back SD card command
+      sdidle();
       b=sdc;
       break;
     case 0xa9: // A_SDD - read SD card data
       if ((sdc&0xc0)==0x80) { // still reading sector data
-        b=sdcard.GetBuf()[dataofs];
+        b=sdbuf[dataofs];
         dataofs++;
         if (dataofs>511)
           sdc|=0x40;
@@ -305,11 +540,307 @@ uint8_t b=0;
     case 0xae:
       b=sd3;
       break;
+    case 0xa6:
+      b=sda;
+      break;
+    case 0xa7:
+      b=sda>>8;
+      break;
+    case 0xaf:
+      b=sdn;
+      break;
   }
   return b;
 }
 
-static void io_write(uint16_t adr,uint8_t b)
+// DMA commands, transfer sdn sectors between card and memory at sda. memory
+// wraps around at 64K like it would for the Z80
+uint8_t Machine::sdtransfer(bool write)
+{
+uint32_t lba=(uint32_t)sd3<<24|(uint32_t)sd2<<16|(uint32_t)sd1<<8|sd0;
+uint8_t r=0,*p;
+uint16_t i;
+  while (sdn) {
+    if (write) {
+      p=sdcard.GetBuf();
+      if (sda<=0x10000-512)
+        memcpy(p,ram+sda,512);
+      else {
+        for (i=0;i<512;i++)
+          p[i]=ram[(uint16_t)(sda+i)];
+      }
+      r=sdcard.WriteSector(lba,p);
+    }
+    else {
+      p=sdcard.GetBuf(lba);
+      if (!p) {
+        p=sdcard.GetBuf();
+        r=sdcard.ReadSector(lba,p);
+      }
+      if (!r) {
+        if (sda<=0x10000-512)
+          memcpy(ram+sda,p,512);
+        else {
+          for (i=0;i<512;i++)
+            ram[(uint16_t)(sda+i)]=p[i];
+        }
+        if (!dmalength)
+          dmastart=sda;
+        dmalength+=512;
+      }
+    }
+    if (r)
+      break;
+    lba++;
+    sda+=512;
+    sdn--;
+  }
+  sd0=lba;
+  sd1=lba>>8;
+  sd2=lba>>16;
+  sd3=lba>>24;
+  return r;
+}
+
+// BIOS READ and WRITE with the deblocking done here. sda points to BIOS
+// parameter block of disk start LBA, disk, track, sector and DMA address
+uint8_t Machine::sdrecord(bool write)
+{
+uint8_t pb[10],r=0,*p;
+uint16_t i,dma,ofs;
+uint32_t lba;
+  for (i=0;i<sizeof(pb);i++)
+    pb[i]=ram[(uint16_t)(sda+i)];
+  // 32 host sectors per track, 4 records per host sector
+  lba=(uint32_t)pb[3]<<24|(uint32_t)pb[2]<<16|(uint32_t)pb[1]<<8|pb[0];
+  lba+=((uint32_t)pb[6]<<8|pb[5])*32+pb[7]/4;
+  ofs=(pb[7]&3)*128;
+  dma=(uint16_t)pb[9]<<8|pb[8];
+  if (write) {
+    p=sdcard.GetBuf();
+    r=sdcard.ReadSector(lba,p);
+    if (!r) {
+      for (i=0;i<128;i++)
+        p[ofs+i]=ram[(uint16_t)(dma+i)];
+      r=sdcard.WriteSector(lba,p);
+    }
+  }
+  else {
+    p=sdcard.GetBuf(lba);
+    if (!p) {
+      p=sdcard.GetBuf();
+      r=sdcard.ReadSector(lba,p);
+    }
+    if (!r) {
+      for (i=0;i<128;i++)
+        ram[(uint16_t)(dma+i)]=p[ofs+i];
+      dmastart=dma;
+      dmalength=128;
+    }
+  }
+  return r;
+}
+
+// BDOS call from BIOS hook. hostpb points to function number, DE and
+// room for the result. returns 1 if host drive did the call, 0 if BDOS
+// has to
+uint8_t Machine::hostcall(void)
+{
+uint16_t de,result;
+  if (!hostdrive)
+    return 0;
+  de=ram[(uint16_t)(hostpb+1)]|ram[(uint16_t)(hostpb+2)]<<8;
+  if (!hostdrive->bdos(ram[hostpb],de,&result))
+    return 0;
+  cpu.writeram(hostpb+3,result);
+  cpu.writeram(hostpb+4,result>>8);
+  #ifdef BLOCKCACHE
+  // FCB and DMA buffer were written behind the CPU's back
+  uint16_t dma=hostdrive->dmaaddress();
+  cpu.invalidatecode(de);
+  cpu.invalidatecode(de+35);
+  cpu.invalidatecode(dma);
+  cpu.invalidatecode(dma+127);
+  #endif
+  return 1;
+}
+
+// hands a sector command over to the I/O thread, or runs it right away.
+// A_SDC gets its completion bit when the emulation thread collects the
+// result in sdidle() or sdwait()
+void Machine::sdstart(uint8_t cmd)
+{
+  sdinflight=true;
+  #ifdef ASYNCSD
+  pthread_t t;
+  if (!sdthreadstarted) {
+    sdthreadstarted=!pthread_create(&t,NULL,sdthreadmain,this);
+    sdthread=t;
+  }
+  if (sdthreadstarted) {
+    pthread_mutex_lock(&sdlock);
+    sdpending=cmd;
+    pthread_cond_broadcast(&sdcond);
+    pthread_mutex_unlock(&sdlock);
+    return;
+  }
+  #endif
+  sdexecute(cmd);
+  sdwait();
+}
+
+// does the card side of a sector command. on the I/O thread this only
+// touches the card, SD registers and RAM for DMA, emulation thread leaves
+// these alone until it has collected the result
+void Machine::sdexecute(uint8_t cmd)
+{
+uint32_t lba=(uint32_t)sd3<<24|(uint32_t)sd2<<16|(uint32_t)sd1<<8|sd0;
+uint8_t n=sdn;
+  switch (cmd) {
+    case 0: // read, straight from the image if it is mapped
+      sectorsread++;
+      sdbuf=sdcard.GetBuf(lba);
+      if (sdbuf)
+        sds=0;
+      else {
+        sdbuf=sdcard.GetBuf();
+        sds=sdcard.ReadSector(lba,sdbuf);
+      }
+      dataofs=0;
+      break;
+    case 1: // write, data is already in sdbuf
+      sectorswritten++;
+      sds=sdcard.WriteSector(lba,sdbuf);
+      break;
+    case 5: // DMA read
+    case 6: // DMA write
+      dmalength=0;
+      sds=sdtransfer(cmd==6);
+      if (cmd==6)
+        sectorswritten+=n-sdn;
+      else
+        sectorsread+=n-sdn;
+      break;
+    #ifdef HLEDISK
+    case 7: // CP/M record read
+    case 8: // CP/M record write
+      dmalength=0;
+      sds=sdrecord(cmd==8);
+      if (cmd==8)
+        sectorswritten++;
+      else
+        sectorsread++;
+      break;
+    #endif
+  }
+}
+
+#ifdef ASYNCSD
+void *Machine::sdthreadmain(void *arg)
+{
+Machine *m=(Machine*)arg;
+uint8_t cmd;
+  blocktimer();
+  pthread_mutex_lock(&m->sdlock);
+  while (!m->sdquit) {
+    if (m->sdpending==SDIDLE) {
+      pthread_cond_wait(&m->sdcond,&m->sdlock);
+      continue;
+    }
+    cmd=m->sdpending;
+    pthread_mutex_unlock(&m->sdlock);
+    m->sdexecute(cmd);
+    pthread_mutex_lock(&m->sdlock);
+    m->sdpending=SDIDLE;
+    pthread_cond_broadcast(&m->sdcond);
+  }
+  pthread_mutex_unlock(&m->sdlock);
+  return NULL;
+}
+#endif
+
+// true if no sector command is running, collects the result of one that
+// has just completed
+bool Machine::sdidle(void)
+{
+  if (!sdinflight)
+    return true;
+  #ifdef ASYNCSD
+  pthread_mutex_lock(&sdlock);
+  if (sdpending!=SDIDLE) {
+    pthread_mutex_unlock(&sdlock);
+    return false;
+  }
+  pthread_mutex_unlock(&sdlock);
+  #endif
+  sdfinish();
+  return true;
+}
+
+// waits for running sector command to complete, and collects the result
+void Machine::sdwait(void)
+{
+  if (!sdinflight)
+    return;
+  #ifdef ASYNCSD
+  pthread_mutex_lock(&sdlock);
+  while (sdpending!=SDIDLE)
+    pthread_cond_wait(&sdcond,&sdlock);
+  pthread_mutex_unlock(&sdlock);
+  #endif
+  sdfinish();
+}
+
+// completed command becomes visible to Z80
+void Machine::sdfinish(void)
+{
+  sdinflight=false;
+  sdc|=0x80;
+  #ifdef BLOCKCACHE
+  // RAM written by DMA may have had code in it
+  for (uint32_t a=dmastart&0xff00;a<(uint32_t)dmastart+dmalength;a+=256)
+    cpu.invalidatecode(a);
+  #endif
+  dmalength=0;
+}
+
+#ifdef FASTBLOCKOPS
+// A_SDD reads and writes as many bytes as there are left in the sector,
+// anything past that goes through io_read/io_write
+uint16_t Machine::io_readblock(uint16_t adr,uint8_t *data,uint16_t n)
+{
+  if (adr!=0xa9)
+    return 0;
+  sdwait();
+  if ((sdc&0xc0)!=0x80)
+    return 0;
+  if (n>512-dataofs)
+    n=512-dataofs;
+  memcpy(data,sdbuf+dataofs,n);
+  dataofs+=n;
+  if (dataofs>511)
+    sdc|=0x40;
+  return n;
+}
+
+uint16_t Machine::io_writeblock(uint16_t adr,const uint8_t *data,uint16_t n)
+{
+  if (adr!=0xa9)
+    return 0;
+  sdwait();
+  if (sdc!=1 || dataofs>511)
+    return 0;
+  if (n>512-dataofs)
+    n=512-dataofs;
+  memcpy(sdbuf+dataofs,data,n);
+  dataofs+=n;
+  if (dataofs>511)
+    sdstart(1);
+  return n;
+}
+#endif
+
+void Machine::io_write(uint16_t adr,uint8_t b)
 {
 uint32_t s;
 #ifdef INSTRUCTIONPROFILER
@@ -317,6 +848,8 @@ uint32_t v32;
 uint16_t i;
 uint8_t c;
 #endif
+  if (adr>=0xa6) // SD card registers are busy until completion
+    sdwait();
   switch (adr) {
 
     // misc commands
@@ -327,7 +860,8 @@ uint8_t c;
           state=BIOS;
           count=0;
           break;
-        case 1: // reboot
+        case 1: // reboot, not while a DMA may still be writing RAM
+          sdwait();
           copy_bootloader();
           cpu.reset();
           state=IDLE;
@@ -337,15 +871,18 @@ uint8_t c;
           count=0;
           break;
         case 3: // reset timecounter
-          timecounter=0;
+          timebase=hostticks();
+          #ifdef CYCLECOUNTER
+          cyclebase=cpu.cycles;
+          #endif
           break;
         case 4: // read timecounter
           state=TIMECOUNTER;
-          timecountersnapshot=timecounter;
+          timecountersnapshot=timecounter();
           break;
         case 5: // dump instruction profiler data
           #ifdef INSTRUCTIONCOUNTER
-          timecountersnapshot=timecounter;
+          timecountersnapshot=timecounter();
           #endif
           #ifdef INSTRUCTIONPROFILER
           console.print("\r\n");
@@ -373,20 +910,63 @@ uint8_t c;
           printf("\r\n%llu instructions in %u ticks (%u IPS)\r\n",
             profilecounter,timecountersnapshot,(uint32_t)(profilecounter/(timecountersnapshot/100)));
           #endif
+          #ifdef CYCLECOUNTER
+          timecountersnapshot=timecounter();
+          cyclesnapshot=cpu.cycles-cyclebase;
+          // ticks are 10ms, so T-states per tick over 10 is kHz
+          printf("\r\n%llu T-states in %u ticks (%llu kHz)\r\n",
+            (unsigned long long)cyclesnapshot,timecountersnapshot,
+            (unsigned long long)(cyclesnapshot/(timecountersnapshot?timecountersnapshot:1)/10));
+          #endif
+          #ifdef PCPROFILER
+          if (profiler)
+            profiler->report(cpu.pccounts,PROFILECYCLES);
+          #endif
+          #ifdef CALLPROFILER
+          if (profiler)
+            profiler->folded();
+          #endif
           break;          
-        case 6:
-          exit(0);
+        case 6: // exit
+          finished=true;
+          break;
+        case 7: // flush SD card, the I/O thread must not be using it
+          sdwait();
+          sdcard.Flush();
+          synctime=hostticks();
           break;
+        case 8: // is there a host drive
+          state=HOSTQUERY;
+          break;
+        case 9: // host drive BDOS call, parameter block address follows
+          state=HOSTCALL;
+          count=0;
+          break;
+        #ifdef CYCLECOUNTER
+        case 10: // read T-states
+          state=TSTATES;
+          cyclesnapshot=cpu.cycles-cyclebase;
+          break;
+        #endif
         default:
           state=IDLE;
           break;
       }
       break;
 
+    case 0xa1: // misc data
+      if (state==HOSTCALL) {
+        hostpb=count ? (hostpb&0xff)|(b<<8) : b;
+        count++;
+      }
+      break;
+
     // console output
 
     case 0xa2: // console data
       console.send(b);
+      conspolls=0;
+      idlepolls=0;
       break;
 
     // aux output/control
@@ -410,12 +990,16 @@ uint8_t c;
       sdc=b;
       switch (b) {
         case 0: // read
-          sds=sdcard.ReadSector((uint32_t)sd3<<24|(uint32_t)sd2<<16|(uint32_t)sd1<<8|sd0,
-            sdcard.GetBuf());
-          dataofs=0;
-          sdc|=0x80;
+        case 5: // DMA read
+        case 6: // DMA write
+        #ifdef HLEDISK
+        case 7: // CP/M record read
+        case 8: // CP/M record write
+        #endif
+          sdstart(b);
           break;
         case 1: // write, this will need data from data register first
+          sdbuf=sdcard.GetBuf(); // so that partial sector never hits the image
           dataofs=0;
           break;
         case 2: // get card type
@@ -432,6 +1016,7 @@ uint8_t c;
           break;
         case 4: // reset
           sds=sdcard.Init(true); // silent initialize
+          sdbuf=sdcard.GetBuf(); // old image mapping is gone
           sdc|=0x80;
           break;
         default: // unknowns
@@ -442,12 +1027,9 @@ uint8_t c;
       break;
     case 0xa9: // SDD
       if (sdc==1 && dataofs<512) {
-        sdcard.GetBuf()[dataofs++]=b;
-        if (dataofs>511) {
-          sds=sdcard.WriteSector((uint32_t)sd3<<24|(uint32_t)sd2<<16|(uint32_t)sd1<<8|sd0,
-             sdcard.GetBuf());
-          sdc|=0x80;
-        }
+        sdbuf[dataofs++]=b;
+        if (dataofs>511)
+          sdstart(1);
       }
       break;
     case 0xab:
@@ -462,6 +1044,15 @@ uint8_t c;
     case 0xae:
       sd3=b;
       break;
+    case 0xa6:
+      sda=(sda&0xff00)|b;
+      break;
+    case 0xa7:
+      sda=(sda&0xff)|(uint16_t)b<<8;
+      break;
+    case 0xaf:
+      sdn=b;
+      break;
   }
 }
 
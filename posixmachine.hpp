@@ -0,0 +1,155 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __posixmachine_hpp__
+#define __posixmachine_hpp__
+
+#include "z80.hpp"
+#include "console.hpp"
+#include "aux.hpp"
+#include "sdcard.hpp"
+#include "machine.hpp"
+#include "posixhostdrive.hpp"
+#include "posixprofiler.hpp"
+
+// sector reads and writes run on a separate I/O thread of the machine
+// while Z80 polls A_SDC for completion. make it noASYNCSD to run them
+// on the emulation thread
+#define ASYNCSD
+
+// SD commands 7 and 8 that do BIOS READ and WRITE record deblocking on
+// host side. BIOS falls back to doing it in Z80 code with noHLEDISK
+#define HLEDISK
+
+#ifdef ASYNCSD
+#include <pthread.h>
+#endif
+
+// -fpack-struct would leave mutexes unaligned, and futex needs them aligned
+#define LOCKALIGN __attribute__((aligned(8)))
+
+// written SD card sectors are synced to image file at least this often,
+// in 10ms ticks
+#define SDSYNCTICKS 100
+
+// stdout buffer for console and aux output. it is written out once per
+// 10ms tick, when Z80 waits for input, or when it fills up
+#define CONSOLEBUFFER 4096
+
+// empty console status reads between two idle() calls that make the
+// machine count as waiting for input. BIOS input loop does thousands of
+// them in one instruction batch
+#define IDLEPOLLS 1000
+
+/*
+one complete emulated machine, with its own CPU, RAM, I/O devices and SD
+card image. any number of these can exist in a process, the only shared
+thing is the host terminal that posixmain connects to one of them
+*/
+class Machine
+{
+  enum MSTATE { IDLE, BIOS, CPM, TIMECOUNTER, HOSTQUERY, HOSTCALL, TSTATES };
+
+  uint32_t timebase;           // host 10ms ticks at last timecounter reset
+  uint32_t timecountersnapshot;
+#ifdef CYCLECOUNTER
+  uint64_t cyclebase;          // cpu.cycles at last timecounter reset
+  uint64_t cyclesnapshot;
+#endif
+  uint8_t auxbaud;
+  uint8_t sd0,sd1,sd2,sd3,sds; // SD card LBA, status
+  uint8_t sdc;                 // SD card command
+  uint16_t dataofs;            // SD card data offset in sector buffer
+  uint8_t *sdbuf;              // sector buffer, may point into card image
+  uint16_t sda;                // SD card DMA address
+  uint8_t sdn;                 // SD card DMA sector count
+  uint16_t dmastart,dmalength; // memory written by last DMA read
+  bool sdinflight;             // sector command started but not collected
+  uint8_t sdpending;           // command for I/O thread, SDIDLE if none
+#ifdef ASYNCSD
+  bool sdthreadstarted,sdquit;
+  pthread_t sdthread;
+  pthread_mutex_t sdlock LOCKALIGN;
+  pthread_cond_t sdcond LOCKALIGN;
+  static void *sdthreadmain(void *arg);
+#endif
+  uint32_t synctime;           // host ticks at last SD card sync
+  uint32_t flushtime;          // host ticks at last console output flush
+  uint8_t conspolls;           // console status reads since last output
+  uint16_t idlepolls;          // same, since last idle() check
+  MSTATE state;
+  uint16_t count;
+  uint16_t hostpb;             // BIOS parameter block for host drive call
+
+public:
+  z80 cpu;
+  Console console;
+  Aux aux;
+  SDCard sdcard;
+  uint8_t ram[65536L];
+  uint8_t iospace[256];
+  bool finished;               // Z80 code has asked emulator to exit
+  HostDrive *hostdrive;        // drive served from host directory, or NULL
+  Profiler *profiler;          // PCPROFILER and CALLPROFILER output, or NULL
+  uint32_t sectorsread;        // card sectors the Z80 side has asked for
+  uint32_t sectorswritten;
+
+  Machine(const char *imagefile="sdcardimage.dsk");
+  ~Machine();
+
+  void sdstart(uint8_t cmd);
+  void sdexecute(uint8_t cmd);
+  bool sdidle(void);
+  void sdwait(void);
+  void sdfinish(void);
+  uint8_t sdtransfer(bool write);
+  uint8_t sdrecord(bool write);
+  uint8_t hostcall(void);
+  uint32_t timecounter(void);
+  void poll(void);
+  bool idle(void);
+  void sleep(void);
+  uint8_t io_read(uint16_t adr);
+  void io_write(uint16_t adr,uint8_t b);
+  #ifdef FASTBLOCKOPS
+  uint16_t io_readblock(uint16_t adr,uint8_t *data,uint16_t n);
+  uint16_t io_writeblock(uint16_t adr,const uint8_t *data,uint16_t n);
+  #endif
+  void copy_bootloader(void);
+  void boot(bool initcard=true,bool checkcard=true);
+};
+
+// puts host terminal to raw mode and starts feeding keys and timer
+// ticks to the console of given machine
+void initialize_terminal(Machine *m);
+// disconnects it again, before the machine is deleted
+void release_terminal(void);
+
+// runs the jobs listed in jobfile on headless machines using given number
+// of worker threads, 0 for one per host core. see posixfarm.cpp
+int runfarm(int workers,const char *jobfile);
+
+// runs the workloads listed in suitefile one at a time on a headless
+// machine and prints their timings, see posixbench.cpp
+int runbench(const char *suitefile);
+
+#endif
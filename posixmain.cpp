@@ -23,16 +23,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
 
-#include "z80.hpp"
-#include "console.hpp"
-#include "aux.hpp"
+#include "posixmachine.hpp"
 #include "partitioner.hpp"
-#include "machine.hpp"
-#include "sdcard.hpp"
 
-z80 cpu;
-SDCard sdcard;
+#define MAXMHZ 400000
+// card sizes for -s in MB, the smallest one that partitioner accepts and the
+// largest one that can be counted in 32 bit sectors
+#define MINCARDMB ((MINCARDSECTORS+2047)/2048)
+#define MAXCARDMB 2097151
 
 int main(int argc,char *argv[])
 {
@@ -40,17 +42,85 @@ bool forcemonitor=false;
 FILE *fp;
 uint8_t c;
 int adr=0x100; // CPM program area start
-  initialize_machine();
+char *end;
+#ifdef CYCLECOUNTER
+uint32_t mhz=0; // emulated clock for -t, 0 runs flat out
+struct timespec next,now;
+#endif
+Machine *m;
+  if (argc==4 && !strcmp(argv[1],"--farm"))
+    return runfarm(atoi(argv[2]),argv[3]);
+  if (argc==3 && !strcmp(argv[1],"--bench"))
+    return runbench(argv[2]);
+  m=new Machine();
+  initialize_terminal(m);
   for (int i=1;i<argc;i++) {
     if (!strcmp(argv[i],"-m"))
       forcemonitor=true;
+    if (!strcmp(argv[i],"-s") && i+1<argc) { // card size in MB for new image
+      unsigned long mb=strtoul(argv[++i],&end,10);
+      if (*end || mb<MINCARDMB || mb>MAXCARDMB) {
+        printf("-s needs a card size from %u to %u MB\r\n",MINCARDMB,MAXCARDMB);
+        release_terminal();
+        delete m;
+        return 1;
+      }
+      m->sdcard.SetImageSize(mb*2048);
+    }
+    if (!strcmp(argv[i],"-o") && i+1<argc) // keep card writes in overlay file
+      m->sdcard.SetOverlay(argv[++i]);
+    if (!strcmp(argv[i],"-c") && i+1<argc) // sectors to cache, 0 for none
+      m->sdcard.SetCacheSize(atol(argv[++i]));
+    if (!strcmp(argv[i],"-d") && i+1<argc) { // [X:]directory as a drive
+      const char *dir=argv[++i];
+      uint8_t drive=15; // P: unless given
+      if (isalpha((unsigned char)dir[0]) && dir[1]==':') {
+        drive=toupper((unsigned char)dir[0])-'A';
+        dir+=2;
+      }
+      m->hostdrive=new HostDrive(m->ram,dir,drive);
+    }
+    if (!strcmp(argv[i],"-p") && i+1<argc) { // per address profile report
+      #ifndef PCPROFILER
+      printf("built without PCPROFILER, see z80.hpp\r\n");
+      #endif
+      if (!m->profiler)
+        m->profiler=new Profiler();
+      m->profiler->setreport(argv[++i]);
+    }
+    if (!strcmp(argv[i],"-f") && i+1<argc) { // folded call stack samples
+      #ifndef CALLPROFILER
+      printf("built without CALLPROFILER, see z80.hpp\r\n");
+      #endif
+      if (!m->profiler)
+        m->profiler=new Profiler();
+      m->profiler->setfolded(argv[++i]);
+    }
+    if (!strcmp(argv[i],"-y") && i+1<argc) { // symbols for profile reports
+      i++;
+      if (!m->profiler || !m->profiler->loadmap(argv[i]))
+        printf("-y needs -p or -f first and a readable pyz80 map file\r\n");
+    }
+    if (!strcmp(argv[i],"-t") && i+1<argc) { // emulated clock in MHz
+      i++;
+      #ifdef CYCLECOUNTER
+      // 10ms worth of T-states has to fit stepcycles()
+      mhz=strtoul(argv[i],&end,10);
+      if (*end || mhz>MAXMHZ) {
+        printf("-t needs a clock from 1 to %u MHz, running flat out\r\n",MAXMHZ);
+        mhz=0;
+      }
+      #else
+      printf("built without CYCLECOUNTER, see z80.hpp\r\n");
+      #endif
+    }
     if (!strcmp(argv[i],"-l")) { // load program into ram
       i++;
       fp=fopen(argv[i],"rb");
       if (fp) {
         while ((adr<=0xffff) && !ferror(fp) && !(feof(fp))) {
           fread(&c,1,1,fp);
-          cpu.writeram(adr++,c);
+          m->cpu.writeram(adr++,c);
         }
         fclose(fp);
         printf("loaded %s, %d pages\r\n",argv[i],(adr+255)>>8);
@@ -58,16 +128,33 @@ int adr=0x100; // CPM program area start
       }
     }
   }
-  if (!forcemonitor)
-    sdcard.Init();
-  console.init();
-  aux.init();
-  console.print("\ec\x0f\e[H\e[2JZ80 emulator for 1.0\r\n");
-  checkdisk();
-  copy_bootloader();
-  cpu.reset();
-  while (1) {
-    cpu.step(10000); // running z80 instructions in batches reduces overhead
+  m->boot(!forcemonitor);
+  #ifdef CYCLECOUNTER
+  clock_gettime(CLOCK_MONOTONIC,&next);
+  #endif
+  while (!m->finished) {
+    #ifdef CYCLECOUNTER
+    if (mhz) { // 10ms worth of T-states, then wait for the next 10ms
+      m->cpu.stepcycles(mhz*10000);
+      m->poll();
+      next.tv_nsec+=10000000;
+      if (next.tv_nsec>=1000000000) {
+        next.tv_nsec-=1000000000;
+        next.tv_sec++;
+      }
+      clock_gettime(CLOCK_MONOTONIC,&now);
+      if (now.tv_sec>next.tv_sec+1) // host can not keep up, do not catch up
+        next=now;
+      clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL);
+      continue;
+    }
+    #endif
+    m->cpu.step(10000); // running z80 instructions in batches reduces overhead
+    m->poll();
+    if (m->idle()) // waiting for a key, no need to spin
+      m->sleep();
   } 
+  release_terminal(); // no more ticks or keys for it
+  delete m; // syncs SD card image
+  return 0;
 }
-
@@ -0,0 +1,329 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "posixprofiler.hpp"
+
+Profiler::Profiler() :
+  symbols(NULL),nsymbols(0),samples(NULL),nsamples(0),samplesize(0)
+{
+  reportfile[0]=0;
+  foldedfile[0]=0;
+}
+
+Profiler::~Profiler()
+{
+  free(symbols);
+  free(samples);
+}
+
+void Profiler::setreport(const char *file)
+{
+  snprintf(reportfile,sizeof(reportfile),"%s",file);
+}
+
+void Profiler::setfolded(const char *file)
+{
+  snprintf(foldedfile,sizeof(foldedfile),"%s",file);
+}
+
+static int bysymboladdress(const void *a,const void *b)
+{
+  return (int)*(const uint16_t*)a-(int)*(const uint16_t*)b;
+}
+
+// hex number as pyz80 may write it, 0x1234, $1234, 1234h or 1234
+static bool parsehex(const char *s,uint32_t *v)
+{
+char *end;
+  if (*s=='$')
+    s++;
+  else if (s[0]=='0' && (s[1]=='x' || s[1]=='X'))
+    s+=2;
+  if (!isxdigit((unsigned char)*s))
+    return false;
+  *v=strtoul(s,&end,16);
+  return (!*end || ((*end=='h' || *end=='H') && !end[1])) && *v<=0xffff;
+}
+
+// label and address from every line that has them, in whatever order and
+// separated by whitespace, colons, commas or equal signs
+bool Profiler::loadmap(const char *mapfile)
+{
+FILE *f;
+char line[256],*t,*name;
+uint32_t v,adr=0;
+bool found;
+SYMBOL *s;
+  f=fopen(mapfile,"r");
+  if (!f)
+    return false;
+  while (fgets(line,sizeof(line),f)) {
+    name=NULL;
+    found=false;
+    for (t=strtok(line," \t\r\n:,=");t;t=strtok(NULL," \t\r\n:,=")) {
+      if (!name && (isalpha((unsigned char)*t) || *t=='_' || *t=='.')) {
+        name=t;
+        continue;
+      }
+      if (parsehex(t,&v)) {
+        adr=v;
+        found=true;
+      }
+    }
+    if (!name || !found)
+      continue;
+    s=(SYMBOL*)realloc(symbols,(nsymbols+1)*sizeof(SYMBOL));
+    if (!s)
+      break;
+    symbols=s;
+    symbols[nsymbols].adr=adr;
+    snprintf(symbols[nsymbols].name,sizeof(symbols[0].name),"%s",name);
+    nsymbols++;
+  }
+  fclose(f);
+  qsort(symbols,nsymbols,sizeof(SYMBOL),bysymboladdress);
+  return true;
+}
+
+// index of the closest symbol at or below address, -1 if none
+int32_t Profiler::lookup(uint16_t adr)
+{
+int32_t lo=0,hi=nsymbols-1,mid,r=-1;
+  while (lo<=hi) {
+    mid=(lo+hi)/2;
+    if (symbols[mid].adr<=adr) {
+      r=mid;
+      lo=mid+1;
+    }
+    else
+      hi=mid-1;
+  }
+  return r;
+}
+
+typedef struct {
+  uint32_t key;
+  uint64_t count;
+} PROFILEROW;
+
+static int bycount(const void *a,const void *b)
+{
+const PROFILEROW *x=(const PROFILEROW*)a,*y=(const PROFILEROW*)b;
+  if (x->count!=y->count)
+    return x->count<y->count ? 1 : -1;
+  return (int)x->key-(int)y->key;
+}
+
+// hottest addresses, then the same counts summed per symbol. cycles adds
+// T-states to both, sitecycles and sitecalls list the costliest calls by
+// return address, which is right after the call instruction
+void Profiler::report(const instructioncounter_t *counts,const uint64_t *cycles,
+  const uint64_t *sitecycles,const instructioncounter_t *sitecalls)
+{
+FILE *f;
+PROFILEROW *rows;
+uint64_t *symcycles=NULL;
+uint32_t i,n;
+int32_t s;
+uint64_t total=0,totalcycles=0;
+  if (!reportfile[0])
+    return;
+  f=fopen(reportfile,"w");
+  if (!f)
+    return;
+  rows=(PROFILEROW*)malloc((65536+nsymbols+1)*sizeof(PROFILEROW));
+  if (cycles)
+    symcycles=(uint64_t*)calloc(nsymbols+1,sizeof(uint64_t));
+  if (!rows || (cycles && !symcycles)) {
+    free(rows);
+    fclose(f);
+    return;
+  }
+  for (n=i=0;i<65536;i++) {
+    total+=counts[i];
+    if (cycles)
+      totalcycles+=cycles[i];
+    if (counts[i]) {
+      rows[n].key=i;
+      rows[n++].count=counts[i];
+    }
+  }
+  qsort(rows,n,sizeof(PROFILEROW),bycount);
+  fprintf(f,"# %llu instructions\n",(unsigned long long)total);
+  if (cycles)
+    fprintf(f,"# %llu T-states\n",(unsigned long long)totalcycles);
+  fprintf(f,"# %-18s %8s ","count","%");
+  if (cycles)
+    fprintf(f,"%20s ","T-states");
+  fprintf(f," address  symbol\n");
+  for (i=0;i<n && i<PROFILETOP;i++) {
+    s=lookup(rows[i].key);
+    fprintf(f,"%20llu %7.3f%% ",(unsigned long long)rows[i].count,
+      100.0*rows[i].count/total);
+    if (cycles)
+      fprintf(f,"%20llu ",(unsigned long long)cycles[rows[i].key]);
+    fprintf(f," %04x     ",rows[i].key);
+    if (s>=0)
+      fprintf(f,"%s+0x%x\n",symbols[s].name,rows[i].key-symbols[s].adr);
+    else
+      fprintf(f,"?\n");
+  }
+  // symbol index+1 as key, 0 for addresses below the first one
+  memset(rows,0,(nsymbols+1)*sizeof(PROFILEROW));
+  for (i=0;i<=nsymbols;i++)
+    rows[i].key=i;
+  for (i=0;i<65536;i++) {
+    s=lookup(i)+1;
+    rows[s].count+=counts[i];
+    if (cycles)
+      symcycles[s]+=cycles[i];
+  }
+  qsort(rows,nsymbols+1,sizeof(PROFILEROW),bycount);
+  fprintf(f,"\n# %-18s %8s ","count","%");
+  if (cycles)
+    fprintf(f,"%20s ","T-states");
+  fprintf(f," address  symbol\n");
+  for (i=0;i<=nsymbols && rows[i].count;i++) {
+    fprintf(f,"%20llu %7.3f%% ",(unsigned long long)rows[i].count,
+      100.0*rows[i].count/total);
+    if (cycles)
+      fprintf(f,"%20llu ",(unsigned long long)symcycles[rows[i].key]);
+    if (rows[i].key)
+      fprintf(f," %04x     %s\n",symbols[rows[i].key-1].adr,
+        symbols[rows[i].key-1].name);
+    else
+      fprintf(f," 0000     ?\n");
+  }
+  // T-states include everything called from there on
+  if (sitecycles && sitecalls) {
+    for (n=i=0;i<65536;i++)
+      if (sitecalls[i]) {
+        rows[n].key=i;
+        rows[n++].count=sitecycles[i];
+      }
+    qsort(rows,n,sizeof(PROFILEROW),bycount);
+    fprintf(f,"\n# %-18s %20s  return   caller\n","T-states","calls");
+    for (i=0;i<n && i<PROFILETOP;i++) {
+      fprintf(f,"%20llu %20llu  %04x     ",(unsigned long long)rows[i].count,
+        (unsigned long long)sitecalls[rows[i].key],rows[i].key);
+      framename(f,rows[i].key);
+      fprintf(f,"\n");
+    }
+  }
+  free(symcycles);
+  free(rows);
+  fclose(f);
+}
+
+static uint32_t stackhash(const uint16_t *frames,uint8_t n)
+{
+uint32_t h=2166136261u;
+  for (uint8_t i=0;i<n;i++)
+    h=(h^frames[i])*16777619u;
+  return h;
+}
+
+// entry for call stack, new one if it has not been seen yet
+Profiler::STACKSAMPLE *Profiler::slot(const uint16_t *frames,uint8_t n)
+{
+uint32_t i=stackhash(frames,n)&(samplesize-1);
+  while (samples[i].n &&
+    (samples[i].n!=n || memcmp(samples[i].frames,frames,n*sizeof(frames[0]))))
+    i=(i+1)&(samplesize-1);
+  if (!samples[i].n) {
+    samples[i].n=n;
+    memcpy(samples[i].frames,frames,n*sizeof(frames[0]));
+    nsamples++;
+  }
+  return &samples[i];
+}
+
+// counts one more sighting of call stack, return addresses outermost
+// first and current PC last
+void Profiler::sample(const uint16_t *frames,uint8_t n)
+{
+STACKSAMPLE *old;
+uint32_t i,oldsize;
+uint16_t key[CALLSTACKDEPTH+1];
+int32_t s;
+  // addresses in the same routine are one and the same frame
+  for (i=0;i<n;i++) {
+    s=lookup(frames[i]);
+    key[i]=s>=0 ? symbols[s].adr : frames[i];
+  }
+  if (nsamples*2>=samplesize) { // keep the table at most half full
+    old=samples;
+    oldsize=samplesize;
+    samplesize=samplesize ? samplesize*2 : 1024;
+    samples=(STACKSAMPLE*)calloc(samplesize,sizeof(STACKSAMPLE));
+    if (!samples) {
+      samples=old;
+      samplesize=oldsize;
+      return;
+    }
+    nsamples=0;
+    for (i=0;i<oldsize;i++)
+      if (old[i].n)
+        slot(old[i].frames,old[i].n)->count=old[i].count;
+    free(old);
+  }
+  slot(key,n)->count++;
+}
+
+// routine that address is in, or the address if there is no symbol for it
+void Profiler::framename(FILE *f,uint16_t adr)
+{
+int32_t s=lookup(adr);
+  if (s>=0)
+    fprintf(f,"%s",symbols[s].name);
+  else
+    fprintf(f,"0x%04x",adr);
+}
+
+// one line per distinct stack, frames separated by semicolons and
+// followed by sample count, as flamegraph.pl and friends read them
+void Profiler::folded(void)
+{
+FILE *f;
+uint32_t i;
+uint8_t j;
+  if (!foldedfile[0])
+    return;
+  f=fopen(foldedfile,"w");
+  if (!f)
+    return;
+  for (i=0;i<samplesize;i++) {
+    if (!samples[i].n)
+      continue;
+    for (j=0;j<samples[i].n;j++) {
+      if (j)
+        fputc(';',f);
+      framename(f,samples[i].frames[j]);
+    }
+    fprintf(f," %llu\n",(unsigned long long)samples[i].count);
+  }
+  fclose(f);
+}
@@ -0,0 +1,77 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __posixprofiler_hpp__
+#define __posixprofiler_hpp__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "z80.hpp"
+
+// addresses listed in the report
+#define PROFILETOP 50
+
+/*
+turns z80::pccounts into a report of the hottest addresses and the
+routines they belong to, with T-states and per call site totals when the
+core counts them, and collects samples of z80 call stack into
+folded stacks for flamegraph tools. routine names come from pyz80 map
+files, each address is charged to the closest label at or below it
+*/
+class Profiler
+{
+  typedef struct {
+    uint16_t adr;
+    char name[32];
+  } SYMBOL;
+
+  // one distinct call stack and the number of times it was seen
+  typedef struct {
+    uint16_t frames[CALLSTACKDEPTH+1] __attribute__((aligned(2)));
+    uint8_t n;         // 0 for unused entry
+    uint64_t count;
+  } STACKSAMPLE;
+
+  char reportfile[256];
+  char foldedfile[256];
+  SYMBOL *symbols;       // sorted by address
+  uint32_t nsymbols;
+  STACKSAMPLE *samples;  // open addressing hash table
+  uint32_t nsamples,samplesize;
+
+  int32_t lookup(uint16_t adr);
+  STACKSAMPLE *slot(const uint16_t *frames,uint8_t n);
+  void framename(FILE *f,uint16_t adr);
+
+public:
+  Profiler();
+  ~Profiler();
+  void setreport(const char *file);
+  void setfolded(const char *file);
+  bool loadmap(const char *mapfile);
+  void report(const instructioncounter_t *counts,const uint64_t *cycles=NULL,
+    const uint64_t *sitecycles=NULL,const instructioncounter_t *sitecalls=NULL);
+  void sample(const uint16_t *frames,uint8_t n);
+  void folded(void);
+};
+
+#endif
@@ -63,4 +63,52 @@ public:
     return c;
   }  
 };
+
+#ifndef __AVR_ARCH__
+// lock free single producer single consumer ring for passing data from one
+// thread to another. size must be power of two. only producer may Push,
+// only consumer may Pop and Purge
+template <class T,uint32_t S=256> class Ring
+{
+  T q[S];
+  uint32_t head __attribute__((aligned(64))); // written by producer only
+  uint32_t tail __attribute__((aligned(64))); // written by consumer only
+public:
+  Ring() : head(0),tail(0)
+  {
+  }
+
+  void Purge()
+  {
+    __atomic_store_n(&tail,__atomic_load_n(&head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+  }
+  uint32_t Count()
+  {
+    return __atomic_load_n(&head,__ATOMIC_ACQUIRE)-__atomic_load_n(&tail,__ATOMIC_ACQUIRE);
+  }
+  bool IsFull() { return Count()>=S; }
+
+  // false if there is no room
+  bool Push(T c)
+  {
+    uint32_t h=__atomic_load_n(&head,__ATOMIC_RELAXED);
+    if (h-__atomic_load_n(&tail,__ATOMIC_ACQUIRE)>=S)
+      return false;
+    q[h&(S-1)]=c;
+    __atomic_store_n(&head,h+1,__ATOMIC_RELEASE);
+    return true;
+  }
+
+  T Pop()
+  {
+    T c=0;
+    uint32_t t=__atomic_load_n(&tail,__ATOMIC_RELAXED);
+    if (__atomic_load_n(&head,__ATOMIC_ACQUIRE)!=t) {
+      c=q[t&(S-1)];
+      __atomic_store_n(&tail,t+1,__ATOMIC_RELEASE);
+    }
+    return c;
+  }
+};
+#endif
 #endif
@@ -31,6 +31,21 @@
 #endif
 #include <string.h>
 #include <stdint.h>
+#ifndef __AVR_ARCH__
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sectorcache.hpp"
+
+// overlay delta file record, 4 byte LBA followed by sector data
+#define DELTARECORD (4+512L)
+// default sector cache size, used when image is not mapped writable
+#define SDCACHESECTORS 64
+// stdio buffer for image file, sequential write backs are combined in it
+#define SDFILEBUFFER 65536
+#endif
 
 #include "console.hpp"
 
@@ -88,13 +103,143 @@ private:
   uint32_t TotalSectors; // total number of available sectors after the Type has been set
 #ifndef __AVR_ARCH__
   FILE *cardfile;
+  const char *imagefile;
+  uint32_t imagesectors; // size of newly created images
+  uint8_t *cardmap;      // whole image mapped to memory, NULL if using stdio
+  size_t mapsize;
+  const char *deltaname; // overlay delta file, NULL if image is used directly
+  FILE *deltafile;
+  uint32_t *deltaindex;  // delta record number+1 for every sector, 0 if none
+  uint32_t deltacount;   // number of records in delta file
+  uint32_t dirtylo,dirtyhi; // range of sectors written since last Flush()
+  SectorCache cache;
+  uint32_t cachesectors;
+  uint32_t appendsector;  // sector right after last stdio write to image
 #endif
 
 public:
 
+#ifdef __AVR_ARCH__
   SDCard() : Type(SDType::NONE),TotalSectors(0)  
   {
   }
+#else
+  SDCard() : Type(SDType::NONE),TotalSectors(0),cardfile(NULL),
+    imagefile("sdcardimage.dsk"),imagesectors(524288L),cardmap(NULL),
+    mapsize(0),deltaname(NULL),deltafile(NULL),deltaindex(NULL),
+    deltacount(0),dirtylo(1),dirtyhi(0),cachesectors(SDCACHESECTORS),
+    appendsector(0xffffffff)
+  {
+  }
+
+  ~SDCard()
+  {
+    Close();
+  }
+
+  // true if sectors have been written but not yet synced to image file
+  bool Dirty()
+  {
+    return dirtylo<=dirtyhi;
+  }
+
+  // get written sectors to image file. dirty cached sectors are written
+  // back in sector order, and with mapped image this syncs only the pages
+  // that were written to since last call. returns 0xff if anything failed,
+  // what could not be written stays dirty for the next call
+  uint8_t Flush()
+  {
+    long pagesize;
+    uintptr_t start,end;
+    int32_t *list;
+    uint32_t i,n;
+    uint8_t r=0;
+    if (!Dirty())
+      return 0;
+    if (cache.Size()) {
+      list=(int32_t*)malloc(cache.Size()*sizeof(int32_t));
+      n=list?cache.DirtyList(list):0;
+      if (!list)
+        r=0xff;
+      for (i=0;i<n;i++) {
+        if (!WriteImage(cache.Sector(list[i]),cache.Data(list[i])))
+          cache.SetDirty(list[i],false);
+        else
+          r=0xff;
+      }
+      free(list);
+    }
+    if (deltafile) {
+      if (fflush(deltafile) || fsync(fileno(deltafile)))
+        r=0xff;
+    }
+    else if (cardmap) {
+      pagesize=sysconf(_SC_PAGESIZE);
+      start=(uintptr_t)(cardmap+dirtylo*512L)&~(pagesize-1);
+      end=(uintptr_t)(cardmap+(dirtyhi+1)*512L);
+      if (msync((void*)start,end-start,MS_SYNC))
+        r=0xff;
+    }
+    else if (cardfile) {
+      if (fflush(cardfile) || fsync(fileno(cardfile)))
+        r=0xff;
+    }
+    if (!r) {
+      dirtylo=1;
+      dirtyhi=0;
+    }
+    return r;
+  }
+
+  // flush and release the image file. written sectors that still can not
+  // be saved after a retry are reported, there is nowhere left to keep them
+  void Close()
+  {
+    if (Flush() && Flush())
+      perror(deltafile ? deltaname : imagefile);
+    cache.Resize(0);
+    appendsector=0xffffffff;
+    if (cardmap)
+      munmap(cardmap,mapsize);
+    cardmap=NULL;
+    if (cardfile)
+      fclose(cardfile);
+    cardfile=NULL;
+    if (deltafile)
+      fclose(deltafile);
+    deltafile=NULL;
+    free(deltaindex);
+    deltaindex=NULL;
+  }
+
+  // image file to use as card, takes effect on next Init()
+  void SetImageFile(const char *name)
+  {
+    imagefile=name;
+  }
+
+  // use image file as read only base that can be shared between machines,
+  // and keep written sectors in given delta file instead. takes effect on
+  // next Init(), NULL to use image directly again
+  void SetOverlay(const char *name)
+  {
+    deltaname=name;
+  }
+
+  // number of sectors to cache, takes effect on next Init(). writable
+  // mapped image is not cached, as the mapping already is the page cache
+  void SetCacheSize(uint32_t sectors)
+  {
+    cachesectors=sectors;
+  }
+
+  // card size in sectors, takes effect on next Init(). images that are
+  // smaller get extended, larger ones are used in full
+  void SetImageSize(uint32_t sectors)
+  {
+    imagesectors=sectors;
+  }
+#endif
 
   uint32_t GetTotalSectors()
   {
@@ -111,6 +256,18 @@ public:
     return dskbuf;
   }
 
+#ifndef __AVR_ARCH__
+  // pointer to sector inside mapped image, so that it can be read without
+  // copying. NULL if the image is not mapped, use ReadSector() then
+  uint8_t *GetBuf(uint32_t blocknumber)
+  {
+    if (!cardmap || blocknumber>=TotalSectors || cache.Size() ||
+        (deltaindex && deltaindex[blocknumber]))
+      return NULL;
+    return cardmap+blocknumber*512L;
+  }
+#endif
+
   void Invalidate()
   {
     blockmode=false;
@@ -567,53 +724,211 @@ public:
 #endif
 
 #ifndef __AVR_ARCH__  
+  // the image is mapped to memory if possible, otherwise sectors are
+  // accessed with stdio. missing or short image is extended with ftruncate()
+  // so that unwritten sectors are holes in the file and read as zeroes
   uint8_t Init(bool quiet=false)
   {
-    cardfile=fopen("sdcardimage.dsk","r+b");
+    Close();
+    if (deltaname)
+      InitOverlay();
+    else
+      InitImage();
+    if (Type!=SDType::UNKNOWN && (!cardmap || deltaindex))
+      cache.Resize(cachesectors);
+    return Type;
+  }
+
+  void InitImage()
+  {
+    struct stat st;
+    cardfile=fopen(imagefile,"r+b");
     if (!cardfile) {
       perror("SDCard");
       console.print("Recreating SD card image\r\n");
-      cardfile=fopen("sdcardimage.dsk","w+b");
-      if (cardfile) {
-        memset(dskbuf,0,sizeof(dskbuf));
-        for (int i=0;i<524288L;i++) {
-          fwrite(dskbuf,sizeof(dskbuf),1,cardfile);
-        }
-      }
+      cardfile=fopen(imagefile,"w+b");
     }
-    if (!cardfile)
+    if (cardfile)
+      setvbuf(cardfile,NULL,_IOFBF,SDFILEBUFFER);
+    if (!cardfile || fstat(fileno(cardfile),&st))
       Type=SDType::UNKNOWN;      
     else {
       Type=SDType::SD1;
-      TotalSectors=524288L;
+      TotalSectors=st.st_size/512;
+      if (TotalSectors<imagesectors) {
+        if (ftruncate(fileno(cardfile),(off_t)imagesectors*512L))
+          perror("SDCard");
+        else
+          TotalSectors=imagesectors;
+      }
+      mapsize=TotalSectors*512L;
+      if (mapsize) {
+        cardmap=(uint8_t*)mmap(NULL,mapsize,PROT_READ|PROT_WRITE,
+          MAP_SHARED,fileno(cardfile),0);
+        if (cardmap==MAP_FAILED)
+          cardmap=NULL;
+      }
     }
-    return Type;
   }
 
-  uint8_t WriteSector(uint32_t blocknumber,uint8_t *data,
-                      SDCommand cmd=WRITEBLOCK,uint16_t len=512)
+  // base image is mapped read only, and the index of sectors already in
+  // delta file is rebuilt by reading through it
+  void InitOverlay()
   {
-    if (!cardfile)
-      return 0xff;
-    fseek(cardfile,blocknumber*512L,SEEK_SET);
+    struct stat st;
+    uint32_t lba;
+    Type=SDType::UNKNOWN;
+    cardfile=fopen(imagefile,"rb");
+    if (!cardfile || fstat(fileno(cardfile),&st)) {
+      perror(imagefile);
+      return;
+    }
+    TotalSectors=st.st_size/512;
+    mapsize=TotalSectors*512L;
+    if (mapsize) {
+      cardmap=(uint8_t*)mmap(NULL,mapsize,PROT_READ,MAP_SHARED,
+        fileno(cardfile),0);
+      if (cardmap==MAP_FAILED)
+        cardmap=NULL;
+    }
+    deltaindex=(uint32_t*)calloc(TotalSectors+1,sizeof(uint32_t));
+    deltafile=fopen(deltaname,"r+b");
+    if (!deltafile)
+      deltafile=fopen(deltaname,"w+b");
+    if (!deltafile || !deltaindex) {
+      perror(deltaname);
+      return;
+    }
+    deltacount=0;
+    while (fread(&lba,sizeof(lba),1,deltafile) && fread(dskbuf,512,1,deltafile)) {
+      deltacount++;
+      if (lba<TotalSectors)
+        deltaindex[lba]=deltacount;
+    }
+    Type=SDType::SD1;
+  }
+
+  // extend the range of sectors that next Flush() needs to sync
+  void MarkDirty(uint32_t blocknumber)
+  {
+    if (!Dirty())
+      dirtylo=dirtyhi=blocknumber;
+    else if (blocknumber<dirtylo)
+      dirtylo=blocknumber;
+    else if (blocknumber>dirtyhi)
+      dirtyhi=blocknumber;
+  }
+
+  // image level access underneath the cache
+
+  uint8_t WriteImage(uint32_t blocknumber,uint8_t *data)
+  {
+    uint32_t record;
+    if (deltaindex) {
+      record=deltaindex[blocknumber];
+      if (record)
+        fseek(deltafile,(record-1)*DELTARECORD+4,SEEK_SET);
+      else {
+        fseek(deltafile,deltacount*DELTARECORD,SEEK_SET);
+        if (!fwrite(&blocknumber,sizeof(blocknumber),1,deltafile))
+          return 0xff;
+      }
+      if (!fwrite(data,512,1,deltafile))
+        return 0xff;
+      if (!record)
+        deltaindex[blocknumber]=++deltacount;
+      MarkDirty(blocknumber);
+      return 0;
+    }
+    if (cardmap) {
+      memcpy(cardmap+blocknumber*512L,data,512);
+      MarkDirty(blocknumber);
+      return 0;
+    }
+    if (appendsector!=blocknumber)
+      fseek(cardfile,blocknumber*512L,SEEK_SET);
     if (fwrite(data,512,1,cardfile)) {
+      appendsector=blocknumber+1;
+      MarkDirty(blocknumber);
       return 0;
-      fflush(cardfile);
     }
+    appendsector=0xffffffff;
     return 0xff;
   }
 
-  uint8_t ReadSector(uint32_t blocknumber,uint8_t *data,
-    uint16_t len=512,SDCommand cmd=READBLOCK)
+  uint8_t ReadImage(uint32_t blocknumber,uint8_t *data)
   {
-    if (!cardfile)
+    if (deltaindex && deltaindex[blocknumber]) {
+      fseek(deltafile,(deltaindex[blocknumber]-1)*DELTARECORD+4,SEEK_SET);
+      if (fread(data,512,1,deltafile))
+        return 0;
       return 0xff;
+    }
+    if (cardmap) {
+      memcpy(data,cardmap+blocknumber*512L,512);
+      return 0;
+    }
+    appendsector=0xffffffff;
     fseek(cardfile,blocknumber*512L,SEEK_SET);
     if (fread(data,512,1,cardfile))
       return 0;
     return 0xff;
   }
 
+  // entry to reuse for another sector, the sector in it is written back
+  // first if needed. -1 if that fails
+  int32_t CacheEvict()
+  {
+    int32_t e=cache.Oldest();
+    if (cache.IsDirty(e)) {
+      if (WriteImage(cache.Sector(e),cache.Data(e)))
+        return -1;
+    }
+    cache.Drop(e);
+    return e;
+  }
+
+  uint8_t WriteSector(uint32_t blocknumber,uint8_t *data,
+                      SDCommand cmd=WRITEBLOCK,uint16_t len=512)
+  {
+    int32_t e;
+    if (!cardfile || blocknumber>=TotalSectors)
+      return 0xff;
+    if (!cache.Size())
+      return WriteImage(blocknumber,data);
+    e=cache.Lookup(blocknumber);
+    if (e<0) {
+      if ((e=CacheEvict())<0)
+        return 0xff;
+      cache.Assign(e,blocknumber);
+    }
+    memcpy(cache.Data(e),data,512);
+    cache.SetDirty(e,true);
+    MarkDirty(blocknumber);
+    return 0;
+  }
+
+  uint8_t ReadSector(uint32_t blocknumber,uint8_t *data,
+    uint16_t len=512,SDCommand cmd=READBLOCK)
+  {
+    int32_t e;
+    uint8_t c;
+    if (!cardfile || blocknumber>=TotalSectors)
+      return 0xff;
+    if (!cache.Size())
+      return ReadImage(blocknumber,data);
+    e=cache.Lookup(blocknumber);
+    if (e<0) {
+      if ((e=CacheEvict())<0)
+        return 0xff;
+      if ((c=ReadImage(blocknumber,cache.Data(e))))
+        return c;
+      cache.Assign(e,blocknumber);
+    }
+    memcpy(data,cache.Data(e),512);
+    return 0;
+  }
+
 #endif
 
 };
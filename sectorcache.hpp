@@ -0,0 +1,205 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __sectorcache_hpp__
+#define __sectorcache_hpp__
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+LRU cache of 512 byte sectors for the posix SD card. entries are found
+through a hash table on sector number and kept in a list from most to least
+recently used. the cache only does the bookkeeping, reading and writing the
+image and deciding when to write dirty entries back is left to SDCard
+*/
+class SectorCache
+{
+  typedef struct {
+    uint32_t sector;
+    int32_t prev,next;  // LRU list, most recently used first
+    int32_t chain;      // next entry in the same hash bucket
+    bool valid,dirty;
+    uint8_t data[512];
+  } ENTRY;
+
+  ENTRY *entries;
+  int32_t *buckets;
+  uint32_t size,mask;
+  int32_t head,tail;
+
+  int32_t &bucket(uint32_t sector)
+  {
+    return buckets[(sector^(sector>>9))&mask];
+  }
+
+  void unlink(int32_t e)
+  {
+    if (entries[e].prev>=0)
+      entries[entries[e].prev].next=entries[e].next;
+    else
+      head=entries[e].next;
+    if (entries[e].next>=0)
+      entries[entries[e].next].prev=entries[e].prev;
+    else
+      tail=entries[e].prev;
+  }
+
+  void linkfirst(int32_t e)
+  {
+    entries[e].prev=-1;
+    entries[e].next=head;
+    if (head>=0)
+      entries[head].prev=e;
+    head=e;
+    if (tail<0)
+      tail=e;
+  }
+
+  static int compare(const void *a,const void *b)
+  {
+    uint64_t x=*(const uint64_t*)a,y=*(const uint64_t*)b;
+    return x<y?-1:x>y?1:0;
+  }
+
+public:
+  SectorCache() : entries(NULL),buckets(NULL),size(0),mask(0),head(-1),tail(-1)
+  {
+  }
+
+  ~SectorCache()
+  {
+    Resize(0);
+  }
+
+  // drops all contents, dirty entries must be written back before this
+  void Resize(uint32_t sectors)
+  {
+    uint32_t i;
+    free(entries);
+    free(buckets);
+    entries=NULL;
+    buckets=NULL;
+    size=mask=0;
+    head=tail=-1;
+    if (!sectors)
+      return;
+    for (i=1;i<sectors;i<<=1);
+    entries=(ENTRY*)calloc(sectors,sizeof(ENTRY));
+    buckets=(int32_t*)malloc(i*sizeof(int32_t));
+    if (!entries || !buckets) {
+      Resize(0);
+      return;
+    }
+    size=sectors;
+    mask=i-1;
+    for (i=0;i<=mask;i++)
+      buckets[i]=-1;
+    for (i=0;i<size;i++) {
+      entries[i].chain=-1;
+      linkfirst(i);
+    }
+  }
+
+  uint32_t Size() { return size; }
+  uint8_t *Data(int32_t e) { return entries[e].data; }
+  uint32_t Sector(int32_t e) { return entries[e].sector; }
+  bool IsDirty(int32_t e) { return entries[e].dirty; }
+  void SetDirty(int32_t e,bool d) { entries[e].dirty=d; }
+
+  // entry holding given sector, made most recently used. -1 if not cached
+  int32_t Lookup(uint32_t sector)
+  {
+    int32_t e;
+    for (e=bucket(sector);e>=0;e=entries[e].chain) {
+      if (entries[e].sector==sector) {
+        unlink(e);
+        linkfirst(e);
+        return e;
+      }
+    }
+    return -1;
+  }
+
+  // least recently used entry, the one to reuse next
+  int32_t Oldest()
+  {
+    return tail;
+  }
+
+  // removes entry from hash table, so that its data can be overwritten
+  void Drop(int32_t e)
+  {
+    int32_t p;
+    if (!entries[e].valid)
+      return;
+    p=bucket(entries[e].sector);
+    if (p==e)
+      bucket(entries[e].sector)=entries[e].chain;
+    else {
+      while (entries[p].chain!=e)
+        p=entries[p].chain;
+      entries[p].chain=entries[e].chain;
+    }
+    entries[e].chain=-1;
+    entries[e].valid=false;
+    entries[e].dirty=false;
+  }
+
+  // entry now holds given sector, and is most recently used
+  void Assign(int32_t e,uint32_t sector)
+  {
+    Drop(e);
+    entries[e].sector=sector;
+    entries[e].valid=true;
+    entries[e].chain=bucket(sector);
+    bucket(sector)=e;
+    unlink(e);
+    linkfirst(e);
+  }
+
+  // fills list with dirty entries in sector order, returns their count.
+  // list must have room for Size() entries
+  uint32_t DirtyList(int32_t *list)
+  {
+    uint64_t *keys;
+    uint32_t i,n=0;
+    for (i=0;i<size;i++) {
+      if (entries[i].valid && entries[i].dirty)
+        n++;
+    }
+    keys=(uint64_t*)malloc(n*sizeof(uint64_t)+1);
+    if (!keys)
+      return 0;
+    n=0;
+    for (i=0;i<size;i++) {
+      if (entries[i].valid && entries[i].dirty)
+        keys[n++]=(uint64_t)entries[i].sector<<32|i;
+    }
+    qsort(keys,n,sizeof(uint64_t),compare);
+    for (i=0;i<n;i++)
+      list[i]=(int32_t)keys[i];
+    free(keys);
+    return n;
+  }
+};
+
+#endif
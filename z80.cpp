@@ -65,7 +65,11 @@ instructioncounter_t profilercounts[256];
 #endif
 
 #ifdef INSTRUCTIONCOUNTER
+#ifdef __AVR_ARCH__
 instructioncounter_t profilecounter;
+#else
+thread_local instructioncounter_t profilecounter;
+#endif
 #endif
 
 void z80::daa()
@@ -102,42 +106,42 @@ uint8_t y;
     setflags(CFLAG);
 }
 
-uint8_t z80::inc8(uint8_t a)
+// flag computations for the arithmetic helpers below. they are called
+// directly, or from evalflags() when built with LAZYFLAGS
+
+inline void z80::incflags8(uint8_t a)
 {
-uint8_t b;
-  b=a+1;
-  setlogicflags(b);
+  setlogicflags((uint8_t)(a+1));
   clearflags(NFLAG|PVFLAG|HFLAG);
   if ((a&0x0f)==0x0f)
     setflags(HFLAG);
   if (a==0x7f)
     setflags(PVFLAG);
-  return b;
 }
 
-uint8_t z80::dec8(uint8_t a)
+inline void z80::decflags8(uint8_t a)
 {
-uint8_t b;
-  b=a-1;
-  setlogicflags(b);
+  setlogicflags((uint8_t)(a-1));
   setflags(NFLAG);
   clearflags(PVFLAG|HFLAG);
   if ((a&0x0f)==0)
     setflags(HFLAG);
   if (a==0x80)
     setflags(PVFLAG);
-  return b;
 }
 
 // overflow has occured if two numbers with same sign are added together
 // and the sign changes. overflow never occurs if numbers with different signs are
 // added together
 
-uint8_t z80::add8(uint8_t a,uint8_t b) // add and set flags
+// lowest bit of a^b^s is the carry that went into the operation
+
+inline void z80::addflags8(uint8_t a,uint8_t b,uint16_t s)
 {
-uint16_t s;
+#ifdef ALUTABLES
+  flags=(flags&(F5FLAG|F3FLAG))|z80_addflags[((uint32_t)((a^b^s)&1)<<16)|((uint16_t)a<<8)|b];
+#else
 uint16_t x;
-  s=(uint16_t)a+(uint16_t)b;
   x=a^b^s;
   setlogicflags((uint8_t)s); // S and Z
   clearflags(NFLAG|CFLAG|HFLAG|PVFLAG);
@@ -147,45 +151,42 @@ uint16_t x;
     setflags(HFLAG);
   if ((x^(x>>1))&0x80)
     setflags(PVFLAG);
-  return (uint8_t)s;
+#endif
 }
 
-uint8_t z80::adc8(uint8_t a,uint8_t b) // add and set flags
+inline void z80::subflags8(uint8_t a,uint8_t b,uint16_t s)
 {
-uint16_t s;
+#ifdef ALUTABLES
+  flags=(flags&(F5FLAG|F3FLAG))|z80_subflags[((uint32_t)((a^b^s)&1)<<16)|((uint16_t)a<<8)|b];
+#else
 uint16_t x;
-  s=(uint16_t)a+(uint16_t)b+carryflag();
-  x=a^b^s;
-  setlogicflags((uint8_t)s); // S and Z
-  clearflags(NFLAG|CFLAG|HFLAG|PVFLAG);
+  x=(a^b^s);
+  setlogicflags((uint8_t)s); // S & Z
+  setflags(NFLAG);
+  clearflags(CFLAG|HFLAG|PVFLAG);
   if (s&0x100)
     setflags(CFLAG);
   if (x&0x10)
     setflags(HFLAG);
   if ((x^(x>>1))&0x80)
     setflags(PVFLAG);
-  return (uint8_t)s;
+#endif
 }
 
-uint16_t z80::add16(uint16_t a,uint16_t b) // add and set flags
+inline void z80::addflags16(uint16_t a,uint16_t b,uint32_t s)
 {
-uint32_t s;
 uint16_t x;
-  s=(uint32_t)a+(uint32_t)b;
   x=(a^b^s)>>8;
   clearflags(NFLAG|HFLAG|CFLAG);
   if (x&0x10)
     setflags(HFLAG);
   if (x&0x100)
     setflags(CFLAG);  
-  return (uint16_t)s;
 }
 
-uint16_t z80::adc16(uint16_t a,uint16_t b) // add and set flags
+inline void z80::adcflags16(uint16_t a,uint16_t b,uint32_t s)
 {
-uint32_t s;
 uint32_t x;
-  s=(uint32_t)a+(uint32_t)b+carryflag();
   x=(a^b^s)>>8;
   clearflags(NFLAG|HFLAG|CFLAG|ZFLAG|PVFLAG|SFLAG);
   if (x&0x100)
@@ -198,66 +199,278 @@ uint32_t x;
     setflags(SFLAG);
   if ((x^(x>>1))&0x80)
     setflags(PVFLAG);
-  return (uint16_t)s;
 }
 
-uint8_t z80::sub8(uint8_t a,uint8_t b) // substract and set flags
+inline void z80::sbcflags16(uint16_t a,uint16_t b,uint32_t s)
 {
-uint16_t s;
-uint16_t x;
-  s=(uint16_t)a-(uint16_t)b;
-  x=(a^b^s);
-  setlogicflags((uint8_t)s); // S & Z
+uint32_t x;
+  x=(a^b^s)>>8;
+  clearflags(HFLAG|CFLAG|ZFLAG|PVFLAG|SFLAG);
   setflags(NFLAG);
-  clearflags(CFLAG|HFLAG|PVFLAG);
-  if (s&0x100)
+  if (x&0x100)
     setflags(CFLAG);
   if (x&0x10)
     setflags(HFLAG);
+  if (!(uint16_t)s)
+    setflags(ZFLAG);
+  if (s&0x8000)
+    setflags(SFLAG);
   if ((x^(x>>1))&0x80)
     setflags(PVFLAG);
+}
+
+#ifdef LAZYFLAGS
+
+// applies the recorded operation to flags. add8 and sub8 set all the flags
+// any of the recorded operations do, so they just replace whatever is pending,
+// others start by bringing flags up to date because they keep some of them
+// or need carry as input
+void z80::evalflags()
+{
+uint8_t op=lazyop;
+  lazyop=LAZYNONE;
+  switch (op) {
+    case LAZYADD8:
+      addflags8(lazya,lazyb,lazys);
+      break;
+    case LAZYSUB8:
+      subflags8(lazya,lazyb,lazys);
+      break;
+    case LAZYINC8:
+      incflags8(lazya);
+      break;
+    case LAZYDEC8:
+      decflags8(lazya);
+      break;
+    case LAZYADD16:
+      addflags16(lazya,lazyb,lazys);
+      break;
+    case LAZYADC16:
+      adcflags16(lazya,lazyb,lazys);
+      break;
+    case LAZYSBC16:
+      sbcflags16(lazya,lazyb,lazys);
+      break;
+  }
+}
+
+#define FLAGS(op,f,a,b,s) deferflags(op,a,b,s)
+#define FLAGSSYNC(op,f,a,b,s) syncflags(); deferflags(op,a,b,s)
+
+#else
+
+#define FLAGS(op,f,a,b,s) f(a,b,s)
+#define FLAGSSYNC(op,f,a,b,s) f(a,b,s)
+
+#endif
+
+uint8_t z80::inc8(uint8_t a)
+{
+  #ifdef LAZYFLAGS
+  syncflags();
+  deferflags(LAZYINC8,a,0,0);
+  #else
+  incflags8(a);
+  #endif
+  return a+1;
+}
+
+uint8_t z80::dec8(uint8_t a)
+{
+  #ifdef LAZYFLAGS
+  syncflags();
+  deferflags(LAZYDEC8,a,0,0);
+  #else
+  decflags8(a);
+  #endif
+  return a-1;
+}
+
+uint8_t z80::add8(uint8_t a,uint8_t b) // add and set flags
+{
+uint16_t s;
+  s=(uint16_t)a+(uint16_t)b;
+  FLAGS(LAZYADD8,addflags8,a,b,s);
+  return (uint8_t)s;
+}
+
+uint8_t z80::adc8(uint8_t a,uint8_t b) // add and set flags
+{
+uint16_t s;
+  s=(uint16_t)a+(uint16_t)b+carryflag();
+  FLAGS(LAZYADD8,addflags8,a,b,s);
+  return (uint8_t)s;
+}
+
+uint16_t z80::add16(uint16_t a,uint16_t b) // add and set flags
+{
+uint32_t s;
+  s=(uint32_t)a+(uint32_t)b;
+  FLAGSSYNC(LAZYADD16,addflags16,a,b,s);
+  return (uint16_t)s;
+}
+
+uint16_t z80::adc16(uint16_t a,uint16_t b) // add and set flags
+{
+uint32_t s;
+  s=(uint32_t)a+(uint32_t)b+carryflag();
+  FLAGS(LAZYADC16,adcflags16,a,b,s);
+  return (uint16_t)s;
+}
+
+uint8_t z80::sub8(uint8_t a,uint8_t b) // substract and set flags
+{
+uint16_t s;
+  s=(uint16_t)a-(uint16_t)b;
+  FLAGS(LAZYSUB8,subflags8,a,b,s);
   return (uint8_t)s;
 }
 
 uint8_t z80::sbc8(uint8_t a,uint8_t b)
 {
 uint16_t s;
-uint16_t x;
   s=(uint16_t)a-(uint16_t)b-carryflag();
-  x=(a^b^s);
-  setlogicflags((uint8_t)s); // S & Z
-  setflags(NFLAG);
-  clearflags(CFLAG|HFLAG|PVFLAG);
-  if (s&0x100)
-    setflags(CFLAG);
-  if (x&0x10)
-    setflags(HFLAG);
-  if ((x^(x>>1))&0x80)
-    setflags(PVFLAG);
+  FLAGS(LAZYSUB8,subflags8,a,b,s);
   return (uint8_t)s;
 }
 
 uint16_t z80::sbc16(uint16_t a,uint16_t b) // substract and set flags
 {
 uint32_t s;
-uint32_t x;
   s=(uint32_t)a-(uint32_t)b-carryflag();
-  x=(a^b^s)>>8;
-  clearflags(HFLAG|CFLAG|ZFLAG|PVFLAG|SFLAG);
-  setflags(NFLAG);
-  if (x&0x100)
-    setflags(CFLAG);
-  if (x&0x10)
-    setflags(HFLAG);
-  if (!(uint16_t)s)
-    setflags(ZFLAG);
-  if (s&0x8000)
-    setflags(SFLAG);
-  if ((x^(x>>1))&0x80)
-    setflags(PVFLAG);
+  FLAGS(LAZYSBC16,sbcflags16,a,b,s);
   return (uint16_t)s;
 }
 
+#ifdef FASTBLOCKOPS
+
+// block instructions write RAM through rampointer(), this does what writeram()
+// would do for the cache
+static inline void blockwritten(z80 *cpu,uint16_t adr,uint32_t n)
+{
+  #ifdef BLOCKCACHE
+  for (uint32_t a=adr&0xff00;a<(uint32_t)adr+n;a+=256)
+    cpu->invalidatecode(a);
+  #endif
+}
+
+// ldir and lddr, with bc=0 meaning 64K like the loop does. ranges that wrap
+// around or overlap so that the byte by byte copy repeats a pattern are
+// left for the loop
+bool z80::fastblockcopy(bool up)
+{
+uint8_t *ram=rampointer();
+uint32_t n=bc.word?bc.word:0x10000;
+uint32_t src=hl.word,dst=de.word;
+  if (!ram)
+    return false;
+  if (up) {
+    if (src+n>0x10000 || dst+n>0x10000 || (dst>src && dst<src+n))
+      return false;
+  }
+  else {
+    if (src+1<n || dst+1<n)
+      return false;
+    src-=n-1;
+    dst-=n-1;
+    if (dst<src && dst+n>src)
+      return false;
+  }
+  blockwritten(this,dst,n);
+  memmove(&ram[dst],&ram[src],n);
+  if (up) {
+    hl.word+=n;
+    de.word+=n;
+  }
+  else {
+    hl.word-=n;
+    de.word-=n;
+  }
+  bc.word=0;
+  return true;
+}
+
+// cpir and cpdr. flags come from comparing to the last byte looked at,
+// which is the matching one if there was a match
+bool z80::fastblockcompare(bool up)
+{
+uint8_t *ram=rampointer();
+uint32_t n=bc.word?bc.word:0x10000;
+uint32_t k;
+uint8_t *p;
+  if (!ram)
+    return false;
+  if (up) {
+    if ((uint32_t)hl.word+n>0x10000)
+      return false;
+    p=(uint8_t*)memchr(&ram[hl.word],acc,n);
+    k=p?p-&ram[hl.word]+1:n;
+    sub8(acc,ram[hl.word+k-1]);
+    hl.word+=k;
+  }
+  else {
+    if ((uint32_t)hl.word+1<n)
+      return false;
+    for (k=1;k<n && ram[hl.word-k+1]!=acc;k++)
+      ;
+    sub8(acc,ram[hl.word-k+1]);
+    hl.word-=k;
+  }
+  bc.word-=k;
+  return true;
+}
+
+// inir, b=0 meaning 256. returns true if the port took care of all of it
+bool z80::fastblockinput()
+{
+uint8_t *ram=rampointer();
+uint16_t n=bc.bytes.high?bc.bytes.high:256;
+uint16_t m;
+  if (!ram || (uint32_t)hl.word+n>0x10000)
+    return false;
+  m=readioblock(bc.bytes.low,&ram[hl.word],n);
+  blockwritten(this,hl.word,m);
+  hl.word+=m;
+  bc.bytes.high-=m;
+  return m==n;
+}
+
+// otir
+bool z80::fastblockoutput()
+{
+uint8_t *ram=rampointer();
+uint16_t n=bc.bytes.high?bc.bytes.high:256;
+uint16_t m;
+  if (!ram || (uint32_t)hl.word+n>0x10000)
+    return false;
+  m=writeioblock(bc.bytes.low,&ram[hl.word],n);
+  hl.word+=m;
+  bc.bytes.high-=m;
+  return m==n;
+}
+
+#endif
+
+#ifdef CYCLECOUNTER
+
+// no instruction but the repeating ones takes more than 23 T-states, so
+// this does not overshoot by more than one of those. step() counts in 16
+// bits, larger budgets go in several rounds
+void z80::stepcycles(uint32_t tstates)
+{
+uint64_t end=cycles+tstates,n;
+  while (cycles<end) {
+    n=(end-cycles)/23+1;
+    step(n>65535 ? 65535 : n);
+  }
+}
+
+#endif
+
+// with TABLEDISPATCH the instructions are dispatched by z80_handlers.cpp
+// and the switch() based implementation below is left out
+#ifndef TABLEDISPATCH
+
 void z80::step(uint16_t count)
 {
 #ifdef INSTRUCTIONDEBUG
@@ -270,6 +483,7 @@ const char flagnames[8]={'S','Z','_','H','_','P','N','C'};
     DEBUGPHEX(pcreg);
     DEBUGSEND(':');
     #endif
+    PROFILEPC(pcreg);
     tempb=fetch();
     #ifdef INSTRUCTIONPROFILER
     profilercounts[tempb]++;
@@ -280,6 +494,7 @@ const char flagnames[8]={'S','Z','_','H','_','P','N','C'};
     #ifdef INCREMENTREFRESHREGISTER
     ir.bytes.low++;
     #endif
+    CYCLES(z80_cycles[tempb]);
 // if unrecognized instruction is encountered after DD or FD prefix
 // then the instruction is treated as unprefixed by coming back here
 ignoreprefix:
@@ -325,6 +540,7 @@ ignoreprefix:
         break;
       case 0x08: // ex af,af'
         swap(tempb,acc,acc2);
+        syncflags();
         swap(tempb,flags,flags2);
         DEBUGPRINT("         ex af,af'");
         break;
@@ -367,7 +583,7 @@ ignoreprefix:
         tempw=(int8_t)fetch()+pcreg;
         bc.bytes.high--;
         if (bc.bytes.high)
-          pcreg=tempw;
+          branch(tempw);
         DEBUGPRINT("      djnz ");
         DEBUGPHEX16(tempw);
         break;
@@ -450,7 +666,7 @@ ignoreprefix:
       case 0x20: // jr nz,xx
         tempw=(int8_t)fetch()+pcreg;
         if (!testflag(ZFLAG))
-          pcreg=tempw;
+          branch(tempw);
         DEBUGPRINT("      jr nz,");
         DEBUGPHEX16(w);
         break;
@@ -492,7 +708,7 @@ ignoreprefix:
       case 0x28: // jr z,xx
         tempw=(int8_t)fetch()+pcreg;
         if (testflag(ZFLAG))
-          pcreg=tempw;
+          branch(tempw);
         DEBUGPRINT("      jr z,");
         DEBUGPHEX16(tempw);
         break;
@@ -533,7 +749,7 @@ ignoreprefix:
       case 0x30: // 
         tempw=(int8_t)fetch()+pcreg;
         if (!testflag(CFLAG))
-          pcreg=tempw;
+          branch(tempw);
         DEBUGPRINT("      jr nc,");
         DEBUGPHEX16(tempw);
         break;
@@ -579,7 +795,7 @@ ignoreprefix:
       case 0x38: // jr c,xx
         tempw=(int8_t)fetch()+pcreg;
         if (testflag(CFLAG))
-          pcreg=tempw;
+          branch(tempw);
         DEBUGPRINT("      jr c,");
         DEBUGPHEX16(tempw);
         break;
@@ -1181,7 +1397,7 @@ ignoreprefix:
         break;
       case 0xc0: // ret nz
         if (!testflag(ZFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret nz\t");
         break;
       case 0xc1: // pop bc
@@ -1203,8 +1419,7 @@ ignoreprefix:
       case 0xc4: // call nz,xxxx
         tempw=fetchw();
         if (!testflag(ZFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call nz,");
         DEBUGPHEX16(tempw);
@@ -1220,17 +1435,16 @@ ignoreprefix:
         DEBUGPHEX(tempb);
         break;
       case 0xc7: // rst 00
-        pushw(pcreg);
-        pcreg=0;
+        call(0);
         DEBUGPRINT("         rst 00\t");
         break;
       case 0xc8: // ret z
         if (testflag(ZFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret z\t");
         break;
       case 0xc9: // ret
-        pcreg=popw();
+        ret();
         DEBUGPRINT("         ret\t");
         break;
       case 0xca: // jp z,xxxx
@@ -1246,16 +1460,14 @@ ignoreprefix:
       case 0xcc: // call z,xxxx
         tempw=fetchw();
         if (testflag(ZFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call z,");
         DEBUGPHEX16(tempw);
         break;
       case 0xcd: // call xxxx
         tempw=fetchw();
-        pushw(pcreg);
-        pcreg=tempw;
+        call(tempw);
         DEBUGPRINT("   call ");
         DEBUGPHEX16(tempw);
         break;
@@ -1266,13 +1478,12 @@ ignoreprefix:
         DEBUGPHEX(tempb);
         break;
       case 0xcf: // rst 08
-        pushw(pcreg);
-        pcreg=0x0008;
+        call(0x0008);
         DEBUGPRINT("         rst 08\t");
         break;
       case 0xd0: // ret nc
         if (!testflag(CFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret nc\t");
         break;
       case 0xd1: // pop de
@@ -1296,8 +1507,7 @@ ignoreprefix:
       case 0xd4: // call nc,xxxx
         tempw=fetchw();
         if (!testflag(CFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call nc,");
         DEBUGPHEX16(tempw);
@@ -1314,13 +1524,12 @@ ignoreprefix:
         DEBUGPRINT("\t");
         break;
       case 0xd7: // rst 10
-        pushw(pcreg);
-        pcreg=0x0010;
+        call(0x0010);
         DEBUGPRINT("         rst 10\t");
         break;
       case 0xd8: // ret c
         if (testflag(CFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret c\t");
         break;
       case 0xd9: // exx
@@ -1346,8 +1555,7 @@ ignoreprefix:
       case 0xdc: // call c,xxxx
         tempw=fetchw();
         if (testflag(CFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call c,");
         DEBUGPHEX16(tempw);
@@ -1363,13 +1571,12 @@ ignoreprefix:
         DEBUGPHEX(tempb);
         break;
       case 0xdf: // rst 18
-        pushw(pcreg);
-        pcreg=0x0018;
+        call(0x0018);
         DEBUGPRINT("         rst 18\t");
         break;
       case 0xe0: // ret po
         if (!testflag(PVFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret po");
         break;
       case 0xe1: // pop hl
@@ -1393,8 +1600,7 @@ ignoreprefix:
       case 0xe4: // call po,xxxx
         tempw=fetchw();
         if (!testflag(PVFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call po,");
         DEBUGPHEX16(tempw);
@@ -1414,13 +1620,12 @@ ignoreprefix:
         DEBUGPRINT("\t");
         break;
       case 0xe7: // rst 20
-        pushw(pcreg);
-        pcreg=0x0020;
+        call(0x0020);
         DEBUGPRINT("         rst 20\t");
         break;
       case 0xe8: // ret pe
         if (testflag(PVFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret pe\t");
         break;
       case 0xe9: // jp (hl)
@@ -1441,8 +1646,7 @@ ignoreprefix:
       case 0xec: // call pe,xxxx
         tempw=fetchw();
         if (testflag(PVFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call pe,");
         DEBUGPHEX16(tempw);
@@ -1460,17 +1664,16 @@ ignoreprefix:
         DEBUGPRINT("\t");
         break;
       case 0xef: // rst 28
-        pushw(pcreg);
-        pcreg=0x0028;
+        call(0x0028);
         DEBUGPRINT("         rst 28\t");
         break;
       case 0xf0: // ret p
         if (!testflag(SFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret p\t");
         break;
       case 0xf1: // pop af
-        flags=popb();
+        loadflags(popb());
         acc=popb();
         DEBUGPRINT("         pop af\t");
         break;
@@ -1488,15 +1691,14 @@ ignoreprefix:
       case 0xf4: // call p,xxxx
         tempw=fetchw();
         if (!testflag(SFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call p,");
         DEBUGPHEX16(tempw);
         break;
       case 0xf5: // push af
         pushb(acc);
-        pushb(flags);
+        pushb(getflags());
         DEBUGPRINT("         push af");
         break;
       case 0xf6: // or xx
@@ -1509,13 +1711,12 @@ ignoreprefix:
         DEBUGPRINT("\t");
         break;
       case 0xf7: // rst 30
-        pushw(pcreg);
-        pcreg=0x0030;
+        call(0x0030);
         DEBUGPRINT("         rst 30\t");
         break;
       case 0xf8: // ret m
         if (testflag(SFLAG))
-          pcreg=popw();
+          ret();
         DEBUGPRINT("         ret m\t");
         break;
       case 0xf9: // ld sp,hl
@@ -1536,8 +1737,7 @@ ignoreprefix:
       case 0xfc: // call m,xxxx
         tempw=fetchw();
         if (testflag(SFLAG)) {
-          pushw(pcreg);
-          pcreg=tempw;
+          call(tempw);
         }
         DEBUGPRINT("   call m,");
         DEBUGPHEX16(tempw);
@@ -1554,8 +1754,7 @@ ignoreprefix:
         DEBUGPRINT("\t");
         break;
       case 0xff: // rst 58
-        pushw(pcreg);
-        pcreg=0x0038;
+        call(0x0038);
         DEBUGPRINT("         rst 38\t");
         break;
       default:
@@ -1578,7 +1777,7 @@ ignoreprefix:
     DEBUGPRINT(" SP=");
     DEBUGPHEX16(spreg);
     DEBUGPRINT(" ");
-    x=flags;
+    x=getflags();
     for (tempb=0;tempb<8;tempb++) {
       DEBUGSEND(x&0x80?flagnames[tempb]:'_');
       x<<=1;
@@ -1596,6 +1795,7 @@ void z80::emulate_cb()
 {
 uint8_t b,v,x;
   b=fetch();
+  CYCLES(z80_cbcycles[b]);
   switch (b&0x07) { // 3 lsb are register to operate on
     case 0:
       v=bc.bytes.high;
@@ -1892,6 +2092,7 @@ void z80::emulate_ed()
 {
 uint8_t o;
   tempb=fetch();
+  CYCLES(z80_edcycles[tempb]);
   switch (tempb) {
     case 0x40: // in b,(c)
       bc.bytes.high=readio(bc.bytes.low);
@@ -1926,7 +2127,7 @@ uint8_t o;
       break;
     case 0x45: // retn
       iff1=iff2;
-      pcreg=popw();
+      ret();
       DEBUGPRINT("      retn\t");
       break;
     case 0x46: // im 0
@@ -1960,7 +2161,7 @@ uint8_t o;
       DEBUGPRINT(")");
       break;
     case 0x4d: // reti
-      pcreg=popw();
+      ret();
       //RETI is like regular RET for Z80 but peripheral chips also
       //decode it for resetting interrupt daisy chain. as we dont have full
       //bus with M1 signalling and no interrupt support, it does not matter
@@ -2139,7 +2340,7 @@ uint8_t o;
       break;
     case 0xa1: // cpi
       tempb=readram(hl.word);
-      o=flags&CFLAG;
+      o=carryflag();
       sub8(acc,tempb);
       hl.word++;
       bc.word--;
@@ -2189,7 +2390,7 @@ uint8_t o;
       DEBUGPRINT("      ldd\t");
       break;
     case 0xa9: // cpd
-      o=flags&CFLAG;
+      o=carryflag();
       tempb=readram(hl.word);
       sub8(acc,tempb);
       hl.word--;
@@ -2227,6 +2428,10 @@ uint8_t o;
       DEBUGPRINT("      outd\t");
       break;
     case 0xb0: // ldir
+      REPEATCYCLES((uint16_t)(bc.word-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcopy(true))
+      #endif
       do {
         tempb=readram(hl.word);
         writeram(de.word,tempb);
@@ -2239,7 +2444,13 @@ uint8_t o;
       DEBUGPRINT("      ldir\t");
       break;
     case 0xb1: // cpir
-      o=flags&CFLAG;
+      #ifdef CYCLECOUNTER
+      tempw=bc.word;
+      #endif
+      o=carryflag();
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcompare(true))
+      #endif
       do {
         tempb=readram(hl.word);
         sub8(acc,tempb);
@@ -2247,6 +2458,7 @@ uint8_t o;
         bc.word--;
         checkforinterrupts();
       } while (bc.word && !testflag(ZFLAG));
+      REPEATCYCLES((uint16_t)(tempw-bc.word-1)+1);
       clearflags(CFLAG);
       setflags(NFLAG|o);
       if (!bc.word)
@@ -2256,6 +2468,10 @@ uint8_t o;
       DEBUGPRINT("      cpir\t");
       break;
     case 0xb2: // inir
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (!fastblockinput())
+      #endif
       do {
         tempb=readio(bc.bytes.low);
         writeram(hl.word,tempb);
@@ -2268,6 +2484,10 @@ uint8_t o;
       DEBUGPRINT("      inir\t");
       break;
     case 0xb3: // otir
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (!fastblockoutput())
+      #endif
       do {
         tempb=readram(hl.word);
         writeio(bc.bytes.low,tempb);
@@ -2279,6 +2499,10 @@ uint8_t o;
       DEBUGPRINT("      otir\t");
       break;
     case 0xb8: // lddr
+      REPEATCYCLES((uint16_t)(bc.word-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcopy(false))
+      #endif
       do {
         tempb=readram(hl.word);
         writeram(de.word,tempb);
@@ -2291,7 +2515,13 @@ uint8_t o;
       DEBUGPRINT("      lddr\t");
       break;
     case 0xb9: // cpdr
-      o=flags&CFLAG;
+      #ifdef CYCLECOUNTER
+      tempw=bc.word;
+      #endif
+      o=carryflag();
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcompare(false))
+      #endif
       do {
         tempb=readram(hl.word);
         sub8(acc,tempb);
@@ -2299,6 +2529,7 @@ uint8_t o;
         bc.word--;
         checkforinterrupts();
       } while (bc.word!=0 && !testflag(ZFLAG));
+      REPEATCYCLES((uint16_t)(tempw-bc.word-1)+1);
       clearflags(CFLAG);
       setflags(NFLAG|o);
       if (!bc.word)
@@ -2308,6 +2539,7 @@ uint8_t o;
       DEBUGPRINT("      cpdr\t");
       break;
     case 0xba: // indr
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
       do {
         tempb=readio(bc.bytes.low);
         writeram(hl.word,tempb);
@@ -2319,6 +2551,7 @@ uint8_t o;
       DEBUGPRINT("      indr\t");
       break;
     case 0xbb: // otdr 
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
       do {
         tempb=readram(hl.word);
         writeio(bc.bytes.low,tempb);
@@ -2344,6 +2577,7 @@ bool z80::emulate_dd()
 {
 uint8_t o;
   tempb=fetch();
+  CYCLES(z80_ddcycles[tempb]);
   switch (tempb) {
     case 0x09: // add ix,bc
       ix.word=add16(ix.word,bc.word);
@@ -2826,6 +3060,7 @@ uint8_t b,v,o;
 uint16_t w;
   o=fetch();
   b=fetch();
+  CYCLES(z80_ddcbcycles[b]);
   w=o+ix.word; // all instructions take the index, even undocumented
   v=readram(w);
   switch (b) {
@@ -3129,6 +3364,7 @@ bool z80::emulate_fd()
 {
 uint8_t o;
   tempb=fetch();
+  CYCLES(z80_ddcycles[tempb]);
   switch (tempb) {
     case 0x09: // add iy,bc
       iy.word=add16(iy.word,bc.word);
@@ -3612,6 +3848,7 @@ uint8_t b,v,o;
 uint16_t w;
   o=fetch();
   b=fetch();
+  CYCLES(z80_ddcbcycles[b]);
   w=o+iy.word; // all instructions take the index, even undocumented
   v=readram(w);
   switch (b) {
@@ -3909,3 +4146,5 @@ uint16_t w;
       break;
   }
 }
+
+#endif
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #ifdef __AVR_ARCH__
 #include <util/delay.h>
 #endif
@@ -36,9 +37,51 @@
 #define noINSTRUCTIONDEBUG
 #define noINSTRUCTIONPROFILER
 #define INSTRUCTIONCOUNTER
+// PCPROFILER counts executed instructions per address in z80::pccounts,
+// host only. posix machine writes a report of them with -p. together with
+// CYCLECOUNTER it also adds up their T-states in z80::pccycles
+#define noPCPROFILER
+// CALLPROFILER keeps a shadow stack of return addresses next to the Z80
+// stack, host only. posix machine samples it every tick for zemu -f. with
+// CYCLECOUNTER the T-states spent in each call go to z80::sitecycles
+#define noCALLPROFILER
+#define CALLSTACKDEPTH 32
+// CYCLECOUNTER adds up the T-states of executed instructions in z80::cycles
+// from the tables in z80_cycles.c, host only. stepcycles() runs for a budget
+// of them
+#define noCYCLECOUNTER
 #define noINCREMENTREFRESHREGISTER
 #define USEREGISTERVARIABLES
 #define PRINTINSTRUCTIONERRORS
+// step() is normally one big switch() per instruction page. with TABLEDISPATCH
+// it dispatches through per-page handler tables in z80_handlers.cpp instead.
+// the switch is kept as the reference, build both and measure on your host
+#define noTABLEDISPATCH
+// THREADEDDISPATCH uses the same handlers, but step() jumps from one handler
+// straight to the next through a table of label addresses (gcc and clang)
+#define noTHREADEDDISPATCH
+// with LAZYFLAGS the 8 and 16 bit add/substract helpers only record their
+// operands and result, flags are computed when something actually reads them
+#define noLAZYFLAGS
+// ALUTABLES looks up the 8 bit add and substract flags from 256K of
+// precomputed tables instead of working them out bit by bit
+#define noALUTABLES
+// BLOCKCACHE keeps straight line blocks of code that have been run once as
+// pre-fetched instructions with their handlers looked up, and runs them from
+// there until the memory they came from is written. uses the table handlers
+#define noBLOCKCACHE
+#define BLOCKCACHEOPS 16384 // instructions in cache
+#define BLOCKMAXOPS 64      // instructions per block
+// JIT compiles cached blocks that have been run JITTHRESHOLD times into x86-64
+// code calling the instruction handlers directly, see z80_jit.cpp
+#define noJIT
+#define JITTHRESHOLD 32
+#define JITARENA (4L*1024*1024)
+// FASTBLOCKOPS runs ldir, lddr, cpir, cpdr, inir and otir over the whole range
+// at once when the machine gives direct access to RAM with rampointer(). with
+// readioblock()/writeioblock() it can also move data to and from a port in
+// one call. checkforinterrupts() is not called in between bytes then
+#define noFASTBLOCKOPS
 // this macro would be defined if you'd have system with interrupt and/or NMI inputs
 // if empty, no interrupt checking code is created
 #define checkforinterrupts()
@@ -84,13 +127,86 @@ extern instructioncounter_t profilercounts[256];
 #endif
 
 #ifdef INSTRUCTIONCOUNTER
+#ifdef __AVR_ARCH__
 extern instructioncounter_t profilecounter;
+#else
+// one per thread on host, so that machines running in parallel threads
+// do not all keep writing the same cache line
+extern thread_local instructioncounter_t profilecounter;
+#endif
 #endif
 
 #define swap(tmp,a,b) tmp=a;a=b;b=tmp
 
 #ifndef __AVR_ARCH__
 #undef USEREGISTERVARIABLES
+#else
+// handler tables would take 7K of RAM on AVR
+#undef TABLEDISPATCH
+#undef THREADEDDISPATCH
+#undef ALUTABLES
+#undef BLOCKCACHE
+#undef JIT
+#undef FASTBLOCKOPS
+#undef PCPROFILER
+#undef CALLPROFILER
+#undef CYCLECOUNTER
+#endif
+
+#if defined(PCPROFILER) && defined(CYCLECOUNTER)
+#define PROFILEPC(pc) profilepc(pc)
+#elif defined(PCPROFILER)
+#define PROFILEPC(pc) pccounts[pc]++
+#else
+#define PROFILEPC(pc)
+#endif
+
+#ifdef CYCLECOUNTER
+#define CYCLES(n) cycles+=(n)
+#else
+#define CYCLES(n)
+#endif
+// block instructions run all their repeats at once, the last round is in
+// the tables and every other one takes 21
+#define REPEATCYCLES(k) CYCLES(21*((uint32_t)(k)-1))
+
+#ifdef JIT
+#ifndef __x86_64__
+#error "JIT only generates x86-64 code"
+#endif
+#ifndef BLOCKCACHE
+#define BLOCKCACHE
+#endif
+#endif
+
+#ifdef THREADEDDISPATCH
+#ifndef __GNUC__
+#error "THREADEDDISPATCH needs labels as values support from gcc or clang"
+#endif
+#ifndef TABLEDISPATCH
+#define TABLEDISPATCH
+#endif
+#endif
+
+#ifndef LAZYFLAGS
+#define syncflags() ((void)0)
+#define getflags() flags
+#define loadflags(f) flags=(f)
+#endif
+
+#ifdef BLOCKCACHE
+#ifdef THREADEDDISPATCH
+#error "BLOCKCACHE and THREADEDDISPATCH are alternative step() implementations"
+#endif
+#ifndef TABLEDISPATCH
+#define TABLEDISPATCH
+#endif
+#endif
+
+#ifdef TABLEDISPATCH
+#ifdef INSTRUCTIONDEBUG
+#error "INSTRUCTIONDEBUG is only supported by the switch() dispatch"
+#endif
 #endif
 
 typedef union 
@@ -135,7 +251,33 @@ class z80
   bool iff1,iff2;
   uint8_t im;
 
+  #ifdef LAZYFLAGS
+  // the last flag setting operation that has not been evaluated yet
+  enum { LAZYNONE,LAZYADD8,LAZYSUB8,LAZYINC8,LAZYDEC8,LAZYADD16,LAZYADC16,LAZYSBC16 };
+  uint8_t lazyop;
+  uint16_t lazya,lazyb;
+  uint32_t lazys;
+  inline void deferflags(uint8_t op,uint16_t a,uint16_t b,uint32_t s)
+  {
+    lazyop=op;
+    lazya=a;
+    lazyb=b;
+    lazys=s;
+  }
+  void evalflags();
+  inline void syncflags() { if (lazyop) evalflags(); }
+  inline uint8_t getflags() { syncflags(); return flags; }
+  inline void loadflags(uint8_t f) { lazyop=LAZYNONE; flags=f; }
+  #endif
+
   inline uint8_t fetch() {
+    #ifdef BLOCKCACHE
+    if (fetchp) {
+      pcreg++;
+      return *fetchp++;
+    }
+    fetchn++;
+    #endif
     #ifdef INSTRUCTIONDEBUG
     uint8_t b=readram(pcreg++);
     DEBUGPHEX(b);
@@ -158,6 +300,53 @@ class z80
   { 
     return popb()|((uint16_t)(popb())<<8); 
   }
+  // call, rst and taken conditional call and return
+  inline void call(uint16_t adr)
+  {
+    #ifdef CALLPROFILER
+    if (calldepth==CALLSTACKDEPTH) { // lose the outermost
+      calldepth--;
+      memmove(callstack,callstack+1,calldepth*sizeof(callstack[0]));
+      memmove(callsp,callsp+1,calldepth*sizeof(callsp[0]));
+      #ifdef CYCLECOUNTER
+      memmove(callstart,callstart+1,calldepth*sizeof(callstart[0]));
+      #endif
+    }
+    #ifdef CYCLECOUNTER
+    callstart[calldepth]=cycles;
+    #endif
+    callstack[calldepth]=pcreg;
+    callsp[calldepth++]=spreg-2;
+    #endif
+    pushw(pcreg);
+    pcreg=adr;
+    CYCLES(7);
+  }
+  inline void ret()
+  {
+    CYCLES(6);
+    #ifdef CALLPROFILER
+    // return address may not be from the innermost call, code can drop
+    // frames by moving SP. unknown ones are not calls at all
+    for (uint8_t i=calldepth;i;i--)
+      if (callsp[i-1]==spreg) {
+        calldepth=i-1;
+        #ifdef CYCLECOUNTER
+        // inclusive, the return itself and all calls made from there
+        sitecycles[callstack[calldepth]]+=cycles-callstart[calldepth];
+        sitecalls[callstack[calldepth]]++;
+        #endif
+        break;
+      }
+    #endif
+    pcreg=popw();
+  }
+  // taken jr and djnz
+  inline void branch(uint16_t adr)
+  {
+    pcreg=adr;
+    CYCLES(5);
+  }
 
   // these emulate instructions on extended instruction pages
   // and are called by emulate() as needed
@@ -181,25 +370,189 @@ class z80
   uint16_t adc16(uint16_t a,uint16_t b);
   uint16_t sbc16(uint16_t a,uint16_t b);
 
+  #ifdef FASTBLOCKOPS
+  // whole range versions of the repeating block instructions, these return
+  // false if they can't do it and the instruction has to loop as usual
+  bool fastblockcopy(bool up);
+  bool fastblockcompare(bool up);
+  bool fastblockinput();
+  bool fastblockoutput();
+  #endif
+  // flag computations of the above, given operands and the untruncated result
+  void addflags8(uint8_t a,uint8_t b,uint16_t s);
+  void subflags8(uint8_t a,uint8_t b,uint16_t s);
+  void incflags8(uint8_t a);
+  void decflags8(uint8_t a);
+  void addflags16(uint16_t a,uint16_t b,uint32_t s);
+  void adcflags16(uint16_t a,uint16_t b,uint32_t s);
+  void sbcflags16(uint16_t a,uint16_t b,uint32_t s);
+
   // set Z, PV, and S flags based on value r
-  #define setlogicflags(r) flags=( (flags& (~(ZFLAG|PVFLAG|SFLAG))) | z80_logicflags[(uint8_t)r] )
+  #define setlogicflags(r) syncflags(),flags=( (flags& (~(ZFLAG|PVFLAG|SFLAG))) | z80_logicflags[(uint8_t)r] )
+
+  #ifdef TABLEDISPATCH
+  // table driven dispatch, see z80_handlers.cpp. there is one handler
+  // template per instruction page, instantiated for every opcode so that
+  // the compiler reduces each instance to just the code for that opcode
+  typedef void (z80::*handler)();
+  static const handler maintable[256];
+  static const handler cbtable[256];
+  static const handler edtable[256];
+  static const handler ddtable[256];
+  static const handler fdtable[256];
+  static const handler ddcbtable[256];
+  static const handler fdcbtable[256];
+  template <uint8_t OP> void mainop();
+  template <uint8_t OP> void cbop();
+  template <uint8_t OP> void edop();
+  template <uint8_t OP,register16 z80::*IDX> void idxop();
+  template <uint8_t OP,register16 z80::*IDX> void idxcbop();
+  template <uint8_t OP> uint8_t cbalu(uint8_t v);
+  template <register16 z80::*IDX> uint8_t &idxreg8(uint8_t r);
+  uint8_t &reg8(uint8_t r);
+  uint16_t reg16(uint8_t r);
+  void setreg16(uint8_t r,uint16_t w);
+  #endif
+
+  #ifdef BLOCKCACHE
+  // pre-fetched instruction, see z80_blockcache.cpp
+  typedef struct {
+    handler h;        // handler for the opcode following any CB/ED/DD/FD
+    uint16_t pc;
+    uint8_t skip;     // instruction bytes consumed before calling h
+    uint8_t n;        // instruction length, 0 ends the block
+    #ifdef CYCLECOUNTER
+    uint8_t cycles;   // T-states of the prefix and opcode pages
+    #endif
+    uint8_t bytes[4];
+  } cachedop;
+  cachedop cacheops[BLOCKCACHEOPS];
+  uint16_t cacheused;
+  uint16_t blockat[65536];  // 1+index of the block starting at an address
+  uint8_t codepages[256];   // which 256 byte pages the cached blocks cover
+  bool blockbroken;         // set when the running block gets invalidated
+  const uint8_t *fetchp;    // fetch() reads instruction bytes from here if set
+  uint8_t fetchn;           // and counts the bytes it read from ram otherwise
+  uint16_t buildblock(uint16_t count);
+  void invalidatepage(uint8_t page);
+  #endif
+
+  #ifdef JIT
+  // compiled block, returns the number of instructions it ran
+  typedef uint16_t (*jitblock)(z80 *cpu);
+  uint8_t blockhits[BLOCKCACHEOPS];   // indexed by first instruction of block
+  jitblock blockcode[BLOCKCACHEOPS];
+  uint8_t *jitarena;
+  uint32_t jitused;
+  void compileblock(uint16_t first);
+  #endif
   
 public:
 
+  // machines on host are allocated and freed, so nothing here can count
+  // on starting out zeroed like a global
+  z80()
+  {
+    #ifdef BLOCKCACHE
+    fetchp=NULL;
+    flushcache();
+    #endif
+    #ifdef JIT
+    jitarena=NULL;
+    jitused=0;
+    #endif
+    #ifdef PCPROFILER
+    memset(pccounts,0,sizeof(pccounts));
+    #ifdef CYCLECOUNTER
+    memset(pccycles,0,sizeof(pccycles));
+    lastpc=0;
+    lastcycles=0;
+    #endif
+    #endif
+    #ifdef CALLPROFILER
+    calldepth=0;
+    #ifdef CYCLECOUNTER
+    memset(sitecycles,0,sizeof(sitecycles));
+    memset(sitecalls,0,sizeof(sitecalls));
+    #endif
+    #endif
+  }
+  #ifdef JIT
+  ~z80(); // gives back the code arena
+  #endif
+
   void reset()
   {
     pcreg=0x0000;
     spreg=0xffff;
     acc=0xff;
-    flags=0xff;
+    loadflags(0xff);
     halted=false;
+    #ifdef CALLPROFILER
+    calldepth=0;
+    #endif
     im=0;
     iff1=false;
     iff2=false;
+    #ifdef BLOCKCACHE
+    flushcache();
+    #endif
   }
   
   void step(uint16_t count=2048);
 
+  #ifdef CYCLECOUNTER
+  // T-states run, never reset by the core
+  uint64_t cycles __attribute__((aligned(8)));
+  // runs until at least tstates more have passed
+  void stepcycles(uint32_t tstates);
+  #endif
+
+  #ifdef PCPROFILER
+  // instructions executed at each address
+  instructioncounter_t pccounts[65536] __attribute__((aligned(8)));
+  #ifdef CYCLECOUNTER
+  // T-states of the instructions at each address. an instruction is
+  // charged when the next one starts, the last one run is not in yet
+  uint64_t pccycles[65536] __attribute__((aligned(8)));
+  uint64_t lastcycles __attribute__((aligned(8)));
+  uint16_t lastpc __attribute__((aligned(2)));
+  inline void profilepc(uint16_t pc)
+  {
+    pccounts[pc]++;
+    pccycles[lastpc]+=cycles-lastcycles;
+    lastpc=pc;
+    lastcycles=cycles;
+  }
+  #endif
+  #endif
+  #ifdef CALLPROFILER
+  uint16_t callstack[CALLSTACKDEPTH]; // return addresses, outermost first
+  uint16_t callsp[CALLSTACKDEPTH];    // SP right after each call
+  uint8_t calldepth;
+  #ifdef CYCLECOUNTER
+  uint64_t callstart[CALLSTACKDEPTH] __attribute__((aligned(8))); // cycles at each call
+  // calls and T-states spent in them per return address, so per call site
+  uint64_t sitecycles[65536] __attribute__((aligned(8)));
+  instructioncounter_t sitecalls[65536] __attribute__((aligned(8)));
+  #endif
+  // shadow stack followed by current PC, returns number of addresses
+  uint8_t backtrace(uint16_t *frames)
+  {
+    memcpy(frames,callstack,calldepth*sizeof(callstack[0]));
+    frames[calldepth]=pcreg;
+    return calldepth+1;
+  }
+  #endif
+
+  // true if halt has been executed since last call
+  bool washalted()
+  {
+    bool h=halted;
+    halted=false;
+    return h;
+  }
+
 /*
 implement these somewhere for your hardware
 */
@@ -208,6 +561,29 @@ implement these somewhere for your hardware
   uint8_t readio(uint16_t adr);
   void writeio(uint16_t adr,uint8_t data);
   void fault(void);   
+  #ifndef __AVR_ARCH__
+  // the machine around this cpu, for the above to find their state
+  class Machine *machine;
+  #endif
+  #ifdef FASTBLOCKOPS
+  // flat 64K of RAM, or NULL if memory can only go through readram/writeram
+  uint8_t *rampointer(void);
+  // move up to n bytes between memory and port, return the number of bytes
+  // moved. the rest are transferred by readio()/writeio() one at a time
+  uint16_t readioblock(uint16_t adr,uint8_t *data,uint16_t n);
+  uint16_t writeioblock(uint16_t adr,const uint8_t *data,uint16_t n);
+  #endif
+
+  #ifdef BLOCKCACHE
+  // writeram() must call this for every write so that blocks get dropped
+  // when the code they were made of is modified
+  inline void invalidatecode(uint16_t adr)
+  {
+    if (codepages[adr>>8])
+      invalidatepage(adr>>8);
+  }
+  void flushcache();
+  #endif
     
 };
 
@@ -0,0 +1,219 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include "z80.hpp"
+
+/*
+Basic block cache. The first time execution reaches an address, step() runs
+the instructions from there one by one as usual, but also records each one
+with its bytes, length and handler from the tables in z80_handlers.cpp. The
+block ends at a taken jump, at the end of the 256 byte page it started in or
+when it gets BLOCKMAXOPS long. Next time the block is run from the recorded
+copy, with fetch() reading the instruction bytes from there instead of
+calling readram().
+
+A conditional jump that was not taken when the block was recorded does not
+end it, so after each instruction pcreg is compared to the address of the
+next one, and the block is left when they differ. Writes to memory drop all
+blocks of the written page, and of the page before it if a block there has
+instructions crossing into it. When the cache fills up it is flushed and
+started over.
+*/
+
+#ifdef BLOCKCACHE
+
+#ifdef INSTRUCTIONPROFILER
+#define PROFILEOP() profilercounts[tempb]++
+#else
+#define PROFILEOP()
+#endif
+#ifdef INSTRUCTIONCOUNTER
+#define COUNTOP() profilecounter++
+#else
+#define COUNTOP()
+#endif
+#ifdef INCREMENTREFRESHREGISTER
+#define REFRESHOP() ir.bytes.low++
+#else
+#define REFRESHOP()
+#endif
+
+// codepages bits
+#define BLOCKSTART 1 // blocks start in this page
+#define BLOCKTAIL  2 // blocks from previous page extend into this one
+
+void z80::flushcache()
+{
+  memset(blockat,0,sizeof(blockat));
+  memset(codepages,0,sizeof(codepages));
+  cacheused=0;
+  blockbroken=true;
+  #ifdef JIT
+  jitused=0;
+  #endif
+}
+
+void z80::invalidatepage(uint8_t page)
+{
+uint8_t prev=page-1;
+  if (codepages[page]&BLOCKSTART)
+    memset(&blockat[(uint16_t)page<<8],0,256*sizeof(blockat[0]));
+  if (codepages[page]&BLOCKTAIL) {
+    memset(&blockat[(uint16_t)prev<<8],0,256*sizeof(blockat[0]));
+    codepages[prev]&=~BLOCKSTART;
+  }
+  codepages[page]=0;
+  blockbroken=true;
+}
+
+// runs instructions from pcreg while recording them as a new block, returns
+// number of instructions run. the block is thrown away if the memory it
+// covers gets written while recording
+uint16_t z80::buildblock(uint16_t count)
+{
+uint16_t start=pcreg,first,n=0,end;
+cachedop *op;
+  if (cacheused>BLOCKCACHEOPS-BLOCKMAXOPS-1)
+    flushcache();
+  first=cacheused;
+  #ifdef JIT
+  blockhits[first]=0;
+  blockcode[first]=NULL;
+  #endif
+  // pages are marked before running anything so that writes to them while
+  // recording get noticed too
+  codepages[start>>8]|=BLOCKSTART;
+  blockbroken=false;
+  fetchp=NULL;
+  while (count--) {
+    op=&cacheops[cacheused];
+    op->pc=pcreg;
+    end=pcreg+sizeof(op->bytes)-1;
+    if ((end>>8)!=(start>>8))
+      codepages[end>>8]|=BLOCKTAIL;
+    for (uint8_t i=0;i<sizeof(op->bytes);i++)
+      op->bytes[i]=readram(pcreg+i);
+    fetchn=0;
+    PROFILEPC(pcreg);
+    tempb=fetch();
+    PROFILEOP();
+    COUNTOP();
+    REFRESHOP();
+    CYCLES(z80_cycles[tempb]);
+    (this->*maintable[tempb])();
+    checkforinterrupts();
+    n++;
+    // longer ones are chains of redundant DD/FD prefixes
+    if (blockbroken || fetchn>sizeof(op->bytes))
+      break;
+    op->n=fetchn;
+    switch (op->bytes[0]) {
+      case 0xcb:
+        op->h=cbtable[op->bytes[1]];
+        op->skip=2;
+        break;
+      case 0xed:
+        op->h=edtable[op->bytes[1]];
+        op->skip=2;
+        break;
+      case 0xdd:
+        op->h=ddtable[op->bytes[1]];
+        op->skip=2;
+        break;
+      case 0xfd:
+        op->h=fdtable[op->bytes[1]];
+        op->skip=2;
+        break;
+      default:
+        op->h=maintable[op->bytes[0]];
+        op->skip=1;
+        break;
+    }
+    #ifdef CYCLECOUNTER
+    // the prefix page handlers are called directly, so their T-states come
+    // with the prefix
+    op->cycles=z80_cycles[op->bytes[0]];
+    if (op->skip==2)
+      op->cycles+=(op->bytes[0]==0xcb?z80_cbcycles:op->bytes[0]==0xed?
+        z80_edcycles:z80_ddcycles)[op->bytes[1]];
+    #endif
+    cacheused++;
+    if (pcreg!=(uint16_t)(op->pc+op->n) || (pcreg>>8)!=(start>>8) ||
+      cacheused-first>=BLOCKMAXOPS)
+      break;
+  }
+  if (blockbroken || cacheused==first) {
+    cacheused=first;
+    return n;
+  }
+  cacheops[cacheused++].n=0;
+  blockat[start]=first+1;
+  return n;
+}
+
+void z80::step(uint16_t count)
+{
+uint16_t b;
+cachedop *op;
+  while (count) {
+    b=blockat[pcreg];
+    if (!b) {
+      count-=buildblock(count);
+      continue;
+    }
+    op=&cacheops[b-1];
+    blockbroken=false;
+    #ifdef JIT
+    if (blockcode[b-1]) {
+      if (count>=BLOCKMAXOPS) {
+        b=blockcode[b-1](this);
+        #ifdef INSTRUCTIONCOUNTER
+        profilecounter+=b;
+        #endif
+        count-=b;
+        op+=b;
+        if (!count || !op->n || pcreg!=op->pc || blockbroken)
+          continue;
+      }
+    }
+    else if (++blockhits[b-1]==JITTHRESHOLD)
+      compileblock(b-1);
+    #endif
+    do {
+      fetchp=&op->bytes[op->skip];
+      pcreg+=op->skip;
+      tempb=op->bytes[0];
+      PROFILEPC(op->pc);
+      PROFILEOP();
+      COUNTOP();
+      REFRESHOP();
+      CYCLES(op->cycles);
+      (this->*op->h)();
+      checkforinterrupts();
+      op++;
+    } while (--count && op->n && pcreg==op->pc && !blockbroken);
+  }
+  fetchp=NULL;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include "z80_flags.h"
+
+/*
+T-states per instruction for CYCLECOUNTER, from the Zilog Z80 CPU user
+manual. the tables hold what is known when the opcode is decoded, the core
+adds the rest where it happens: call() 7 and ret() 6 when a call, rst or
+return is taken, 5 for taken jr and djnz, and 21 for every repeat of the
+block instructions. so conditional ones are listed with their not taken
+time, and call, rst and ret with what is left of theirs.
+*/
+
+// unprefixed instructions, prefixes themselves take 4
+const uint8_t z80_cycles[256] =
+{
+   4,10, 7, 6, 4, 4, 7, 4, 4,11, 7, 6, 4, 4, 7, 4, // 00
+   8,10, 7, 6, 4, 4, 7, 4,12,11, 7, 6, 4, 4, 7, 4, // 10
+   7,10,16, 6, 4, 4, 7, 4, 7,11,16, 6, 4, 4, 7, 4, // 20
+   7,10,13, 6,11,11,10, 4, 7,11,13, 6, 4, 4, 7, 4, // 30
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // 40
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // 50
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // 60
+   7, 7, 7, 7, 7, 7, 4, 7, 4, 4, 4, 4, 4, 4, 7, 4, // 70
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // 80
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // 90
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // A0
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, // B0
+   5,10,10,10,10,11, 7, 4, 5, 4,10, 4,10,10, 7, 4, // C0
+   5,10,10,11,10,11, 7, 4, 5, 4,10,11,10, 4, 7, 4, // D0
+   5,10,10,19,10,11, 7, 4, 5, 4,10, 4,10, 4, 7, 4, // E0
+   5,10,10, 4,10,11, 7, 4, 5, 6,10, 4,10, 4, 7, 4, // F0
+};
+
+// CB page, on top of the prefix
+const uint8_t z80_cbcycles[256] =
+{
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 00
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 10
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 20
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 30
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 40
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 50
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 60
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 70
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 80
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // 90
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // A0
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // B0
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // C0
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // D0
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // E0
+   4, 4, 4, 4, 4, 4,11, 4, 4, 4, 4, 4, 4, 4,11, 4, // F0
+};
+
+// ED page, on top of the prefix
+const uint8_t z80_edcycles[256] =
+{
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 00
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 10
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 20
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 30
+   8, 8,11,16, 4, 4, 4, 5, 8, 8,11,16, 4, 4, 4, 5, // 40
+   8, 8,11,16, 4, 4, 4, 5, 8, 8,11,16, 4, 4, 4, 5, // 50
+   8, 8,11,16, 4, 4, 4,14, 8, 8,11,16, 4, 4, 4,14, // 60
+   8, 8,11,16, 4, 4, 4, 4, 8, 8,11,16, 4, 4, 4, 4, // 70
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 80
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 90
+  12,12,12,12, 4, 4, 4, 4,12,12,12,12, 4, 4, 4, 4, // A0
+  12,12,12,12, 4, 4, 4, 4,12,12,12,12, 4, 4, 4, 4, // B0
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // C0
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // D0
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // E0
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // F0
+};
+
+// DD and FD pages, on top of the prefix. instructions that do not
+// use the index register run as unprefixed ones and take what they do
+const uint8_t z80_ddcycles[256] =
+{
+   4,10, 7, 6, 4, 4, 7, 4, 4,11, 7, 6, 4, 4, 7, 4, // 00
+   8,10, 7, 6, 4, 4, 7, 4,12,11, 7, 6, 4, 4, 7, 4, // 10
+   7,10,16, 6, 4, 4, 7, 4, 7,11,16, 6, 4, 4, 7, 4, // 20
+   7,10,13, 6,19,19,15, 4, 7,11,13, 6, 4, 4, 7, 4, // 30
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // 40
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // 50
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // 60
+  15,15,15,15,15,15, 4,15, 4, 4, 4, 4, 4, 4,15, 4, // 70
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // 80
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // 90
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // A0
+   4, 4, 4, 4, 4, 4,15, 4, 4, 4, 4, 4, 4, 4,15, 4, // B0
+   5,10,10,10,10,11, 7, 4, 5, 4,10, 0,10,10, 7, 4, // C0
+   5,10,10,11,10,11, 7, 4, 5, 4,10,11,10, 4, 7, 4, // D0
+   5,10,10,19,10,11, 7, 4, 5, 4,10, 4,10, 4, 7, 4, // E0
+   5,10,10, 4,10,11, 7, 4, 5, 6,10, 4,10, 4, 7, 4, // F0
+};
+
+// DDCB and FDCB pages, on top of the prefix
+const uint8_t z80_ddcbcycles[256] =
+{
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 00
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 10
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 20
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 30
+  16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16, // 40
+  16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16, // 50
+  16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16, // 60
+  16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16, // 70
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 80
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // 90
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // A0
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // B0
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // C0
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // D0
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // E0
+  19,19,19,19,19,19,19,19,19,19,19,19,19,19,19,19, // F0
+};
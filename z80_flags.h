@@ -38,12 +38,25 @@
 #define NFLAG  0x02
 #define CFLAG  0x01
 
-#define carryflag() (flags&1)
-#define clearflags(b) flags&=~(b)
-#define setflags(b) flags|=b
-#define flipflags(b) flags^=b
-#define testflag(b) (flags&b)
+// syncflags() is provided by z80.hpp, it brings flags up to date when the
+// core is built with LAZYFLAGS and compiles to nothing otherwise
+#define carryflag() (syncflags(),flags&1)
+#define clearflags(b) syncflags(),flags&=~(b)
+#define setflags(b) syncflags(),flags|=b
+#define flipflags(b) syncflags(),flags^=b
+#define testflag(b) (syncflags(),flags&b)
 
 extern const uint8_t z80_logicflags[256];
+// 8 bit add and substract flags indexed by carry<<16|a<<8|b, these are
+// generated by mkalutables.py and only used when built with ALUTABLES
+extern const uint8_t z80_addflags[0x20000];
+extern const uint8_t z80_subflags[0x20000];
+// T-states per instruction page, in z80_cycles.c and only used when built
+// with CYCLECOUNTER
+extern const uint8_t z80_cycles[256];
+extern const uint8_t z80_cbcycles[256];
+extern const uint8_t z80_edcycles[256];
+extern const uint8_t z80_ddcycles[256];
+extern const uint8_t z80_ddcbcycles[256];
 
 #endif
@@ -0,0 +1,1227 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include "z80.hpp"
+
+/*
+table driven alternative to the switch() statements in z80.cpp. every instruction
+page (main, CB, ED, DD, FD, DDCB, FDCB) has a table of 256 handlers, and a
+prefix byte dispatches straight to the handler for the byte that follows
+instead of going through a second switch(). the handlers are templates
+parameterized by the opcode, so the compiler reduces each instance to only
+the code that opcode needs.
+
+z80.cpp remains the reference implementation, so any change in instruction
+behaviour must be made in both places.
+*/
+
+#ifdef TABLEDISPATCH
+
+// threaded step() inlines the unprefixed handlers at its labels, which
+// the compiler would not do on its own when optimizing for size
+#ifdef THREADEDDISPATCH
+#define MAINOPINLINE inline __attribute__((always_inline))
+#else
+#define MAINOPINLINE
+#endif
+
+// flag tested by condition code in bits 4 and 5 of jp/jr/call/ret opcodes,
+// bit 3 selects between flag clear (nz,nc,po,p) and flag set (z,c,pe,m)
+static const uint8_t conditionflags[4] = { ZFLAG,CFLAG,PVFLAG,SFLAG };
+#define testcondition(c) (((c)&1)?(testflag(conditionflags[(c)>>1])!=0):(testflag(conditionflags[(c)>>1])==0))
+
+// 8 bit register by its encoding in opcode, 6 is (hl) and is
+// never passed here
+inline uint8_t &z80::reg8(uint8_t r)
+{
+  switch (r) {
+    case 0:
+      return bc.bytes.high;
+    case 1:
+      return bc.bytes.low;
+    case 2:
+      return de.bytes.high;
+    case 3:
+      return de.bytes.low;
+    case 4:
+      return hl.bytes.high;
+    case 5:
+      return hl.bytes.low;
+    default:
+      return acc;
+  }
+}
+
+// same for IX and IY prefixed instructions, where h and l are replaced by
+// high and low halves of the index register
+template <register16 z80::*IDX> inline uint8_t &z80::idxreg8(uint8_t r)
+{
+  switch (r) {
+    case 4:
+      return (this->*IDX).bytes.high;
+    case 5:
+      return (this->*IDX).bytes.low;
+    default:
+      return reg8(r);
+  }
+}
+
+// 16 bit register pair by its encoding in opcode, 3 is sp. these are
+// not returned by reference as the class may be built with packed fields
+inline uint16_t z80::reg16(uint8_t r)
+{
+  switch (r) {
+    case 0:
+      return bc.word;
+    case 1:
+      return de.word;
+    case 2:
+      return hl.word;
+    default:
+      return spreg;
+  }
+}
+
+inline void z80::setreg16(uint8_t r,uint16_t w)
+{
+  switch (r) {
+    case 0:
+      bc.word=w;
+      break;
+    case 1:
+      de.word=w;
+      break;
+    case 2:
+      hl.word=w;
+      break;
+    default:
+      spreg=w;
+      break;
+  }
+}
+
+// rotate, shift, and bit operations of CB, DDCB and FDCB pages
+template <uint8_t OP> inline uint8_t z80::cbalu(uint8_t v)
+{
+uint8_t x;
+  switch (OP>>3) {
+    case 0: // rlc
+      clearflags(CFLAG|NFLAG|HFLAG);
+      if (v&0x80)
+        setflags(CFLAG);
+      v<<=1;
+      v|=carryflag();
+      setlogicflags(v);
+      break;
+    case 1: // rrc
+      clearflags(CFLAG|NFLAG|HFLAG);
+      if (v&1)
+        setflags(CFLAG);
+      v>>=1;
+      if (testflag(CFLAG))
+        v|=0x80;
+      setlogicflags(v);
+      break;
+    case 2: // rl
+      clearflags(NFLAG|HFLAG);
+      x=v;
+      v=(v<<1)|carryflag();
+      if (x&0x80)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      setlogicflags(v);
+      break;
+    case 3: // rr
+      clearflags(NFLAG|HFLAG);
+      x=v;
+      v=(v>>1);
+      if (testflag(CFLAG))
+        v|=0x80;
+      if (x&0x01)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      setlogicflags(v);
+      break;
+    case 4: // sla
+      clearflags(NFLAG|HFLAG|CFLAG);
+      if (v&0x80)
+        setflags(CFLAG);
+      v=v<<1;
+      setlogicflags(v);
+      break;
+    case 5: // sra
+      clearflags(NFLAG|HFLAG|CFLAG);
+      if (v&0x01)
+        setflags(CFLAG);
+      v=(v&0x80)|(v>>1);
+      setlogicflags(v);
+      break;
+    case 6: // sll
+      clearflags(NFLAG|HFLAG|CFLAG);
+      if (v&0x80)
+        setflags(CFLAG);
+      v=(v<<1)|1;
+      setlogicflags(v);
+      break;
+    case 7: // srl
+      clearflags(NFLAG|HFLAG|CFLAG);
+      if (v&0x01)
+        setflags(CFLAG);
+      v=v>>1;
+      setlogicflags(v);
+      break;
+    default:
+      switch (OP>>6) {
+        case 1: // bit
+          clearflags(ZFLAG|NFLAG);
+          if (!(v&(1<<((OP>>3)&7))))
+            setflags(ZFLAG);
+          setflags(HFLAG);
+          break;
+        case 2: // res
+          v&=~(1<<((OP>>3)&7));
+          break;
+        case 3: // set
+          v|=1<<((OP>>3)&7);
+          break;
+      }
+      break;
+  }
+  return v;
+}
+
+// unprefixed instructions
+template <uint8_t OP> MAINOPINLINE void z80::mainop()
+{
+uint8_t b;
+  switch (OP) {
+    case 0x00: // nop
+      break;
+    case 0x01: // ld rr,xxxx
+    case 0x11:
+    case 0x21:
+    case 0x31:
+      setreg16(OP>>4,fetchw());
+      break;
+    case 0x02: // ld (bc),a
+      writeram(bc.word,acc);
+      break;
+    case 0x03: // inc rr
+    case 0x13:
+    case 0x23:
+    case 0x33:
+      setreg16(OP>>4,reg16(OP>>4)+1);
+      break;
+    case 0x0b: // dec rr
+    case 0x1b:
+    case 0x2b:
+    case 0x3b:
+      setreg16(OP>>4,reg16(OP>>4)-1);
+      break;
+    case 0x04: // inc r
+    case 0x0c:
+    case 0x14:
+    case 0x1c:
+    case 0x24:
+    case 0x2c:
+    case 0x3c:
+      reg8(OP>>3)=inc8(reg8(OP>>3));
+      break;
+    case 0x05: // dec r
+    case 0x0d:
+    case 0x15:
+    case 0x1d:
+    case 0x25:
+    case 0x2d:
+    case 0x3d:
+      reg8(OP>>3)=dec8(reg8(OP>>3));
+      break;
+    case 0x06: // ld r,xx
+    case 0x0e:
+    case 0x16:
+    case 0x1e:
+    case 0x26:
+    case 0x2e:
+    case 0x3e:
+      reg8(OP>>3)=fetch();
+      break;
+    case 0x07: // rlca
+      b=acc;
+      acc=(b<<1)|((b&0x80)?1:0);
+      if (b&0x80)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x08: // ex af,af'
+      swap(b,acc,acc2);
+      syncflags();
+      swap(b,flags,flags2);
+      break;
+    case 0x09: // add hl,rr
+    case 0x19:
+    case 0x29:
+    case 0x39:
+      hl.word=add16(hl.word,reg16(OP>>4));
+      break;
+    case 0x0a: // ld a,(bc)
+      acc=readram(bc.word);
+      break;
+    case 0x0f: // rrca
+      b=acc;
+      acc=(b>>1)|((b&1)?0x80:0);
+      if (b&1)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x10: // djnz xx
+      tempw=(int8_t)fetch()+pcreg;
+      bc.bytes.high--;
+      if (bc.bytes.high)
+        branch(tempw);
+      break;
+    case 0x12: // ld (de),a
+      writeram(de.word,acc);
+      break;
+    case 0x17: // rla
+      b=acc;
+      acc=(b<<1)|carryflag();
+      if (b&0x80)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x18: // jr xx
+      pcreg=(int8_t)fetch()+pcreg;
+      break;
+    case 0x1a: // ld a,(de)
+      acc=readram(de.word);
+      break;
+    case 0x1f: // rra
+      b=acc;
+      acc=(b>>1)|(carryflag()?0x80:0);
+      if (b&1)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x20: // jr cc,xx
+    case 0x28:
+    case 0x30:
+    case 0x38:
+      tempw=(int8_t)fetch()+pcreg;
+      if (testcondition((OP>>3)&3))
+        branch(tempw);
+      break;
+    case 0x22: // ld (xxxx),hl
+      tempw=fetchw();
+      writeram(tempw,hl.bytes.low);
+      writeram(tempw+1,hl.bytes.high);
+      break;
+    case 0x27: // daa
+      daa();
+      break;
+    case 0x2a: // ld hl,(xxxx)
+      tempw=fetchw();
+      hl.bytes.low=readram(tempw);
+      hl.bytes.high=readram(tempw+1);
+      break;
+    case 0x2f: // cpl
+      acc=~acc;
+      setflags(NFLAG|HFLAG);
+      break;
+    case 0x32: // ld (xxxx),a
+      tempw=fetchw();
+      writeram(tempw,acc);
+      break;
+    case 0x34: // inc (hl)
+      writeram(hl.word,inc8(readram(hl.word)));
+      break;
+    case 0x35: // dec (hl)
+      writeram(hl.word,dec8(readram(hl.word)));
+      break;
+    case 0x36: // ld (hl),xx
+      writeram(hl.word,fetch());
+      break;
+    case 0x37: // scf
+      setflags(CFLAG);
+      clearflags(NFLAG|HFLAG);
+      break;
+    case 0x3a: // ld a,(xxxx)
+      tempw=fetchw();
+      acc=readram(tempw);
+      break;
+    case 0x3f: // ccf
+      clearflags(HFLAG|NFLAG);
+      if (carryflag())
+        setflags(HFLAG);
+      flipflags(CFLAG);
+      break;
+    case 0x76: // halt
+      halted=true;
+      break;
+    case 0xc0: // ret cc
+    case 0xc8:
+    case 0xd0:
+    case 0xd8:
+    case 0xe0:
+    case 0xe8:
+    case 0xf0:
+    case 0xf8:
+      if (testcondition((OP>>3)&7))
+        ret();
+      break;
+    case 0xc1: // pop rr
+    case 0xd1:
+    case 0xe1:
+      setreg16((OP>>4)&3,popw());
+      break;
+    case 0xf1: // pop af
+      loadflags(popb());
+      acc=popb();
+      break;
+    case 0xc2: // jp cc,xxxx
+    case 0xca:
+    case 0xd2:
+    case 0xda:
+    case 0xe2:
+    case 0xea:
+    case 0xf2:
+    case 0xfa:
+      tempw=fetchw();
+      if (testcondition((OP>>3)&7))
+        pcreg=tempw;
+      break;
+    case 0xc3: // jp xxxx
+      pcreg=fetchw();
+      break;
+    case 0xc4: // call cc,xxxx
+    case 0xcc:
+    case 0xd4:
+    case 0xdc:
+    case 0xe4:
+    case 0xec:
+    case 0xf4:
+    case 0xfc:
+      tempw=fetchw();
+      if (testcondition((OP>>3)&7)) {
+        call(tempw);
+      }
+      break;
+    case 0xc5: // push rr
+    case 0xd5:
+    case 0xe5:
+      pushw(reg16((OP>>4)&3));
+      break;
+    case 0xf5: // push af
+      pushb(acc);
+      pushb(getflags());
+      break;
+    case 0xc6: // alu a,xx
+    case 0xce:
+    case 0xd6:
+    case 0xde:
+    case 0xe6:
+    case 0xee:
+    case 0xf6:
+    case 0xfe:
+      b=fetch();
+      switch ((OP>>3)&7) {
+        case 0:
+          acc=add8(acc,b);
+          break;
+        case 1:
+          acc=adc8(acc,b);
+          break;
+        case 2:
+          acc=sub8(acc,b);
+          break;
+        case 3:
+          acc=sbc8(acc,b);
+          break;
+        case 4:
+          acc&=b;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG);
+          setflags(HFLAG);
+          break;
+        case 5:
+          acc^=b;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG|HFLAG);
+          break;
+        case 6:
+          acc|=b;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG|HFLAG);
+          break;
+        case 7:
+          sub8(acc,b);
+          break;
+      }
+      break;
+    case 0xc7: // rst xx
+    case 0xcf:
+    case 0xd7:
+    case 0xdf:
+    case 0xe7:
+    case 0xef:
+    case 0xf7:
+    case 0xff:
+      call(OP&0x38);
+      break;
+    case 0xc9: // ret
+      ret();
+      break;
+    case 0xcb: // BITS
+      b=fetch();
+      CYCLES(z80_cbcycles[b]);
+      (this->*cbtable[b])();
+      break;
+    case 0xcd: // call xxxx
+      tempw=fetchw();
+      call(tempw);
+      break;
+    case 0xd3: // out (xx),a
+      writeio(fetch(),acc);
+      break;
+    case 0xd9: // exx
+      swap(tempw,bc.word,bc2.word);
+      swap(tempw,de.word,de2.word);
+      swap(tempw,hl.word,hl2.word);
+      break;
+    case 0xdb: // in a,(xx)
+      acc=readio(fetch());
+      break;
+    case 0xdd: // IX prefix
+      b=fetch();
+      CYCLES(z80_ddcycles[b]);
+      (this->*ddtable[b])();
+      break;
+    case 0xe3: // ex (sp),hl
+      tempw=readram(spreg)|(((uint16_t)readram(spreg+1))<<8);
+      writeram(spreg,hl.bytes.low);
+      writeram(spreg+1,hl.bytes.high);
+      hl.word=tempw;
+      break;
+    case 0xe9: // jp (hl)
+      pcreg=hl.word;
+      break;
+    case 0xeb: // ex de,hl
+      swap(tempw,de.word,hl.word);
+      break;
+    case 0xed: // EXTD prefix
+      b=fetch();
+      CYCLES(z80_edcycles[b]);
+      (this->*edtable[b])();
+      break;
+    case 0xf3: // di
+      iff1=iff2=false;
+      break;
+    case 0xf9: // ld sp,hl
+      spreg=hl.word;
+      break;
+    case 0xfb: // ei
+      iff1=iff2=true;
+      break;
+    case 0xfd: // IY prefix
+      b=fetch();
+      CYCLES(z80_ddcycles[b]);
+      (this->*fdtable[b])();
+      break;
+    default:
+      if (OP>=0x40 && OP<0x80) { // ld r,r
+        if ((OP&7)==6)
+          reg8((OP>>3)&7)=readram(hl.word);
+        else if (((OP>>3)&7)==6)
+          writeram(hl.word,reg8(OP&7));
+        else
+          reg8((OP>>3)&7)=reg8(OP&7);
+      }
+      else { // alu a,r
+        b=(OP&7)==6?readram(hl.word):reg8(OP&7);
+        switch ((OP>>3)&7) {
+          case 0:
+            acc=add8(acc,b);
+            break;
+          case 1:
+            acc=adc8(acc,b);
+            break;
+          case 2:
+            acc=sub8(acc,b);
+            break;
+          case 3:
+            acc=sbc8(acc,b);
+            break;
+          case 4:
+            acc&=b;
+            setlogicflags(acc);
+            clearflags(CFLAG|NFLAG);
+            setflags(HFLAG);
+            break;
+          case 5:
+            acc^=b;
+            setlogicflags(acc);
+            clearflags(CFLAG|NFLAG|HFLAG);
+            break;
+          case 6:
+            acc|=b;
+            setlogicflags(acc);
+            clearflags(CFLAG|NFLAG|HFLAG);
+            break;
+          case 7:
+            sub8(acc,b);
+            break;
+        }
+      }
+      break;
+  }
+}
+
+// bit and rotate instructions
+template <uint8_t OP> void z80::cbop()
+{
+uint8_t v;
+  if ((OP&7)==6)
+    v=readram(hl.word);
+  else
+    v=reg8(OP&7);
+  v=cbalu<OP>(v);
+  if ((OP>>6)!=1) { // bit does not write the result back
+    if ((OP&7)==6)
+      writeram(hl.word,v);
+    else
+      reg8(OP&7)=v;
+  }
+}
+
+// extended instructions
+template <uint8_t OP> void z80::edop()
+{
+uint8_t o;
+  switch (OP) {
+    case 0x40: // in r,(c)
+    case 0x48:
+    case 0x50:
+    case 0x58:
+    case 0x60:
+    case 0x68:
+    case 0x78:
+      reg8((OP>>3)&7)=readio(bc.bytes.low);
+      setlogicflags(reg8((OP>>3)&7));
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x41: // out (c),r
+    case 0x49:
+    case 0x51:
+    case 0x59:
+    case 0x61:
+    case 0x69:
+    case 0x79:
+      writeio(bc.bytes.low,reg8((OP>>3)&7));
+      break;
+    case 0x42: // sbc hl,rr
+    case 0x52:
+    case 0x62:
+    case 0x72:
+      hl.word=sbc16(hl.word,reg16((OP>>4)&3));
+      break;
+    case 0x4a: // adc hl,rr
+    case 0x5a:
+    case 0x6a:
+    case 0x7a:
+      hl.word=adc16(hl.word,reg16((OP>>4)&3));
+      break;
+    case 0x43: // ld (xxxx),rr
+    case 0x53:
+    case 0x73:
+      tempw=fetchw();
+      writeram(tempw,reg16((OP>>4)&3)&255);
+      writeram(tempw+1,reg16((OP>>4)&3)>>8);
+      break;
+    case 0x4b: // ld rr,(xxxx)
+    case 0x5b:
+    case 0x7b:
+      tempw=fetchw();
+      setreg16((OP>>4)&3,readram(tempw)|((uint16_t)readram(tempw+1)<<8));
+      break;
+    case 0x44: // neg
+      o=sub8(0,acc);
+      if (acc)
+        setflags(CFLAG);
+      else
+        clearflags(CFLAG);
+      acc=o;
+      break;
+    case 0x45: // retn
+      iff1=iff2;
+      ret();
+      break;
+    case 0x46: // im 0
+      im=0;
+      break;
+    case 0x47: // ld i,a
+      ir.bytes.high=acc;
+      break;
+    case 0x4d: // reti
+      ret();
+      break;
+    case 0x4f: // ld r,a
+      ir.bytes.low=acc;
+      break;
+    case 0x56: // im 1
+      im=1;
+      break;
+    case 0x57: // ld a,i
+    case 0x5f: // ld a,r
+      acc=OP==0x57?ir.bytes.high:ir.bytes.low;
+      setlogicflags(acc);
+      if (iff2)
+        setflags(PVFLAG);
+      else
+        clearflags(PVFLAG);
+      break;
+    case 0x5e: // im 2
+      im=2;
+      break;
+    case 0x67: // rrd
+      tempw=readram(hl.word)|((uint16_t)acc<<8);
+      acc=(acc&0xf0)|(tempw&0x0f);
+      writeram(hl.word,tempw>>4);
+      setlogicflags(acc);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0x6f: // rld
+      tempw=readram(hl.word)|((uint16_t)acc<<8);
+      acc=(acc&0xf0)|((tempw&0xf0)>>4);
+      writeram(hl.word,(tempw<<4)|((tempw>>8)&0x0f));
+      setlogicflags(acc);
+      clearflags(HFLAG|NFLAG);
+      break;
+    case 0xa0: // ldi
+    case 0xa8: // ldd
+      writeram(de.word,readram(hl.word));
+      if (OP==0xa0) {
+        hl.word++;
+        de.word++;
+      }
+      else {
+        hl.word--;
+        de.word--;
+      }
+      bc.word--;
+      if (!bc.word)
+        clearflags(PVFLAG);
+      else
+        setflags(PVFLAG);
+      clearflags(NFLAG|HFLAG);
+      break;
+    case 0xa1: // cpi
+    case 0xa9: // cpd
+      o=carryflag();
+      sub8(acc,readram(hl.word));
+      if (OP==0xa1)
+        hl.word++;
+      else
+        hl.word--;
+      bc.word--;
+      clearflags(CFLAG);
+      setflags(o|NFLAG);
+      if (!bc.word)
+        clearflags(PVFLAG);
+      else
+        setflags(PVFLAG);
+      break;
+    case 0xa2: // ini
+    case 0xaa: // ind
+      writeram(hl.word,readio(bc.bytes.low));
+      if (OP==0xa2)
+        hl.word++;
+      else
+        hl.word--;
+      bc.bytes.high--;
+      setflags(NFLAG);
+      if (bc.bytes.high)
+        clearflags(ZFLAG);
+      else
+        setflags(ZFLAG);
+      break;
+    case 0xa3: // outi
+    case 0xab: // outd
+      writeio(bc.bytes.low,readram(hl.word));
+      if (OP==0xa3)
+        hl.word++;
+      else
+        hl.word--;
+      bc.bytes.high--;
+      setflags(NFLAG);
+      if (bc.bytes.high)
+        clearflags(ZFLAG);
+      else
+        setflags(ZFLAG);
+      break;
+    case 0xb0: // ldir
+    case 0xb8: // lddr
+      REPEATCYCLES((uint16_t)(bc.word-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcopy(OP==0xb0))
+      #endif
+      do {
+        writeram(de.word,readram(hl.word));
+        if (OP==0xb0) {
+          hl.word++;
+          de.word++;
+        }
+        else {
+          hl.word--;
+          de.word--;
+        }
+        bc.word--;
+        checkforinterrupts();
+      } while (bc.word!=0);
+      clearflags(PVFLAG|HFLAG|NFLAG);
+      break;
+    case 0xb1: // cpir
+    case 0xb9: // cpdr
+      #ifdef CYCLECOUNTER
+      tempw=bc.word;
+      #endif
+      o=carryflag();
+      #ifdef FASTBLOCKOPS
+      if (!fastblockcompare(OP==0xb1))
+      #endif
+      do {
+        sub8(acc,readram(hl.word));
+        if (OP==0xb1)
+          hl.word++;
+        else
+          hl.word--;
+        bc.word--;
+        checkforinterrupts();
+      } while (bc.word && !testflag(ZFLAG));
+      REPEATCYCLES((uint16_t)(tempw-bc.word-1)+1);
+      clearflags(CFLAG);
+      setflags(NFLAG|o);
+      if (!bc.word)
+        clearflags(PVFLAG);
+      else
+        setflags(PVFLAG);
+      break;
+    case 0xb2: // inir
+    case 0xba: // indr
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (OP==0xba || !fastblockinput())
+      #endif
+      do {
+        writeram(hl.word,readio(bc.bytes.low));
+        if (OP==0xb2)
+          hl.word++;
+        else
+          hl.word--;
+        bc.bytes.high--;
+        checkforinterrupts();
+      } while (bc.bytes.high);
+      if (OP==0xb2) {
+        setflags(ZFLAG);
+        clearflags(NFLAG);
+      }
+      else
+        setflags(ZFLAG|NFLAG);
+      break;
+    case 0xb3: // otir
+    case 0xbb: // otdr
+      REPEATCYCLES((uint8_t)(bc.bytes.high-1)+1);
+      #ifdef FASTBLOCKOPS
+      if (OP==0xbb || !fastblockoutput())
+      #endif
+      do {
+        writeio(bc.bytes.low,readram(hl.word));
+        if (OP==0xb3)
+          hl.word++;
+        else
+          hl.word--;
+        bc.bytes.high--;
+        checkforinterrupts();
+      } while (bc.bytes.high);
+      setflags(ZFLAG|NFLAG);
+      break;
+    default:
+      ERRORPRINT("invalid instruction ED ");
+      ERRORPHEX(OP);
+      ERRORPRINT(" at ");
+      ERRORPHEX16(pcreg-2);
+      fault();
+      break;
+  }
+}
+
+// IX and IY instructions, anything not listed here is executed
+// as if there was no prefix
+template <uint8_t OP,register16 z80::*IDX> void z80::idxop()
+{
+register16 &idx=this->*IDX;
+uint8_t o;
+  switch (OP) {
+    case 0x09: // add ix,rr
+    case 0x19:
+    case 0x39:
+      idx.word=add16(idx.word,reg16(OP>>4));
+      break;
+    case 0x29: // add ix,ix
+      idx.word=add16(idx.word,idx.word);
+      break;
+    case 0x21: // ld ix,xxxx
+      idx.word=fetchw();
+      break;
+    case 0x22: // ld (xxxx),ix
+      tempw=fetchw();
+      writeram(tempw,idx.bytes.low);
+      writeram(tempw+1,idx.bytes.high);
+      break;
+    case 0x23: // inc ix
+      idx.word++;
+      break;
+    case 0x2b: // dec ix
+      idx.word--;
+      break;
+    case 0x24: // inc ixh
+    case 0x2c: // inc ixl
+      idxreg8<IDX>(OP>>3)=inc8(idxreg8<IDX>(OP>>3));
+      break;
+    case 0x25: // dec ixh
+    case 0x2d: // dec ixl
+      idxreg8<IDX>(OP>>3)=dec8(idxreg8<IDX>(OP>>3));
+      break;
+    case 0x26: // ld ixh,xx
+    case 0x2e: // ld ixl,xx
+      idxreg8<IDX>(OP>>3)=fetch();
+      break;
+    case 0x2a: // ld ix,(xxxx)
+      tempw=fetchw();
+      idx.bytes.low=readram(tempw);
+      idx.bytes.high=readram(tempw+1);
+      break;
+    case 0x34: // inc (ix+xx)
+      o=fetch();
+      tempw=idx.word+o;
+      writeram(tempw,inc8(readram(tempw)));
+      break;
+    case 0x35: // dec (ix+xx)
+      o=fetch();
+      tempw=idx.word+o;
+      writeram(tempw,dec8(readram(tempw)));
+      break;
+    case 0x36: // ld (ix+xx),xx
+      o=fetch();
+      writeram(idx.word+o,fetch());
+      break;
+    case 0x44: // ld r,ixh
+    case 0x4c:
+    case 0x54:
+    case 0x5c:
+    case 0x7c:
+    case 0x45: // ld r,ixl
+    case 0x4d:
+    case 0x55:
+    case 0x5d:
+    case 0x7d:
+      reg8((OP>>3)&7)=idxreg8<IDX>(OP&7);
+      break;
+    case 0x60: // ld ixh,r
+    case 0x61:
+    case 0x62:
+    case 0x63:
+    case 0x64:
+    case 0x65:
+    case 0x67:
+    case 0x68: // ld ixl,r
+    case 0x69:
+    case 0x6a:
+    case 0x6b:
+    case 0x6c:
+    case 0x6d:
+    case 0x6f:
+      idxreg8<IDX>((OP>>3)&7)=idxreg8<IDX>(OP&7);
+      break;
+    case 0x46: // ld r,(ix+xx)
+    case 0x4e:
+    case 0x56:
+    case 0x5e:
+    case 0x66:
+    case 0x6e:
+    case 0x7e:
+      o=fetch();
+      reg8((OP>>3)&7)=readram(idx.word+o);
+      break;
+    case 0x70: // ld (ix+xx),r
+    case 0x71:
+    case 0x72:
+    case 0x73:
+    case 0x74:
+    case 0x75:
+    case 0x77:
+      o=fetch();
+      writeram(idx.word+o,reg8(OP&7));
+      break;
+    case 0x7f:
+      break;
+    case 0x84: // alu a,ixh
+    case 0x8c:
+    case 0x94:
+    case 0x9c:
+    case 0xa4:
+    case 0xac:
+    case 0xb4:
+    case 0xbc:
+    case 0x85: // alu a,ixl
+    case 0x8d:
+    case 0x95:
+    case 0x9d:
+    case 0xa5:
+    case 0xad:
+    case 0xb5:
+    case 0xbd:
+    case 0x86: // alu a,(ix+xx)
+    case 0x8e:
+    case 0x96:
+    case 0x9e:
+    case 0xa6:
+    case 0xae:
+    case 0xb6:
+    case 0xbe:
+      if ((OP&7)==6) {
+        o=fetch();
+        o=readram(idx.word+o);
+      }
+      else
+        o=idxreg8<IDX>(OP&7);
+      switch ((OP>>3)&7) {
+        case 0:
+          acc=add8(acc,o);
+          break;
+        case 1:
+          acc=adc8(acc,o);
+          break;
+        case 2:
+          acc=sub8(acc,o);
+          break;
+        case 3:
+          acc=sbc8(acc,o);
+          break;
+        case 4:
+          acc&=o;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG);
+          setflags(HFLAG);
+          break;
+        case 5:
+          acc^=o;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG|HFLAG);
+          break;
+        case 6:
+          acc|=o;
+          setlogicflags(acc);
+          clearflags(CFLAG|NFLAG|HFLAG);
+          break;
+        case 7:
+          sub8(acc,o);
+          break;
+      }
+      break;
+    case 0xcb: // ix bits, displacement comes before the opcode
+      o=fetch();
+      tempw=idx.word+o;
+      o=fetch();
+      CYCLES(z80_ddcbcycles[o]);
+      (this->*(IDX==&z80::ix?ddcbtable:fdcbtable)[o])();
+      break;
+    case 0xe1: // pop ix
+      idx.word=popw();
+      break;
+    case 0xe3: // ex (sp),ix
+      o=readram(spreg);
+      writeram(spreg,idx.bytes.low);
+      idx.bytes.low=o;
+      o=readram(spreg+1);
+      writeram(spreg+1,idx.bytes.high);
+      idx.bytes.high=o;
+      break;
+    case 0xe5: // push ix
+      pushw(idx.word);
+      break;
+    case 0xe9: // jp (ix)
+      pcreg=idx.word;
+      break;
+    case 0xf9: // ld sp,ix
+      spreg=idx.word;
+      break;
+    default:
+      mainop<OP>();
+      break;
+  }
+}
+
+// IX and IY bit instructions, tempw has the effective address
+template <uint8_t OP,register16 z80::*IDX> void z80::idxcbop()
+{
+uint8_t v;
+  v=readram(tempw);
+  if ((OP&7)!=6) {
+    ERRORPRINT(IDX==&z80::ix?"invalid instruction DD CB ":"invalid instruction FD CB ");
+    ERRORPHEX(readram(pcreg-2));
+    ERRORPRINT(" ");
+    ERRORPHEX(OP);
+    ERRORPRINT(" at ");
+    ERRORPHEX16(pcreg-3);
+    fault();
+    return;
+  }
+  v=cbalu<OP>(v);
+  if ((OP>>6)!=1)
+    writeram(tempw,v);
+}
+
+#define HANDLERS4(h,n) h(n),h(n+1),h(n+2),h(n+3)
+#define HANDLERS16(h,n) HANDLERS4(h,n),HANDLERS4(h,n+4),HANDLERS4(h,n+8),HANDLERS4(h,n+12)
+#define HANDLERS256(h) \
+  HANDLERS16(h,0x00),HANDLERS16(h,0x10),HANDLERS16(h,0x20),HANDLERS16(h,0x30), \
+  HANDLERS16(h,0x40),HANDLERS16(h,0x50),HANDLERS16(h,0x60),HANDLERS16(h,0x70), \
+  HANDLERS16(h,0x80),HANDLERS16(h,0x90),HANDLERS16(h,0xa0),HANDLERS16(h,0xb0), \
+  HANDLERS16(h,0xc0),HANDLERS16(h,0xd0),HANDLERS16(h,0xe0),HANDLERS16(h,0xf0)
+
+#define MAINOP(n) &z80::mainop<n>
+#define CBOP(n) &z80::cbop<n>
+#define EDOP(n) &z80::edop<n>
+#define DDOP(n) &z80::idxop<n,&z80::ix>
+#define FDOP(n) &z80::idxop<n,&z80::iy>
+#define DDCBOP(n) &z80::idxcbop<n,&z80::ix>
+#define FDCBOP(n) &z80::idxcbop<n,&z80::iy>
+
+const z80::handler z80::maintable[256] = { HANDLERS256(MAINOP) };
+const z80::handler z80::cbtable[256] = { HANDLERS256(CBOP) };
+const z80::handler z80::edtable[256] = { HANDLERS256(EDOP) };
+const z80::handler z80::ddtable[256] = { HANDLERS256(DDOP) };
+const z80::handler z80::fdtable[256] = { HANDLERS256(FDOP) };
+const z80::handler z80::ddcbtable[256] = { HANDLERS256(DDCBOP) };
+const z80::handler z80::fdcbtable[256] = { HANDLERS256(FDCBOP) };
+
+#ifdef THREADEDDISPATCH
+
+// every handler ends by fetching the next opcode and jumping directly to its
+// label, so each opcode gets its own indirect jump for the branch predictor
+// to learn instead of all of them sharing the one at the top of the loop
+#ifdef INSTRUCTIONPROFILER
+#define PROFILEOP() profilercounts[tempb]++
+#else
+#define PROFILEOP()
+#endif
+#ifdef INSTRUCTIONCOUNTER
+#define COUNTOP() profilecounter++
+#else
+#define COUNTOP()
+#endif
+#ifdef INCREMENTREFRESHREGISTER
+#define REFRESHOP() ir.bytes.low++
+#else
+#define REFRESHOP()
+#endif
+
+#define NEXTOP \
+    checkforinterrupts(); \
+    if (!--count) \
+      return; \
+    PROFILEPC(pcreg); \
+    tempb=fetch(); \
+    PROFILEOP(); \
+    COUNTOP(); \
+    REFRESHOP(); \
+    CYCLES(z80_cycles[tempb]); \
+    goto *labels[tempb]
+
+#define OPLABEL(h,l) &&op_##h##l
+#define OPCODE(h,l) op_##h##l: mainop<0x##h##l>(); NEXTOP;
+#define LABELS16(h) OPLABEL(h,0),OPLABEL(h,1),OPLABEL(h,2),OPLABEL(h,3), \
+  OPLABEL(h,4),OPLABEL(h,5),OPLABEL(h,6),OPLABEL(h,7), \
+  OPLABEL(h,8),OPLABEL(h,9),OPLABEL(h,a),OPLABEL(h,b), \
+  OPLABEL(h,c),OPLABEL(h,d),OPLABEL(h,e),OPLABEL(h,f)
+#define OPCODES16(h) OPCODE(h,0) OPCODE(h,1) OPCODE(h,2) OPCODE(h,3) \
+  OPCODE(h,4) OPCODE(h,5) OPCODE(h,6) OPCODE(h,7) \
+  OPCODE(h,8) OPCODE(h,9) OPCODE(h,a) OPCODE(h,b) \
+  OPCODE(h,c) OPCODE(h,d) OPCODE(h,e) OPCODE(h,f)
+
+void z80::step(uint16_t count)
+{
+static const void *const labels[256] = {
+  LABELS16(0),LABELS16(1),LABELS16(2),LABELS16(3),
+  LABELS16(4),LABELS16(5),LABELS16(6),LABELS16(7),
+  LABELS16(8),LABELS16(9),LABELS16(a),LABELS16(b),
+  LABELS16(c),LABELS16(d),LABELS16(e),LABELS16(f)
+};
+  if (!count)
+    return;
+  PROFILEPC(pcreg);
+  tempb=fetch();
+  PROFILEOP();
+  COUNTOP();
+  REFRESHOP();
+  CYCLES(z80_cycles[tempb]);
+  goto *labels[tempb];
+  OPCODES16(0) OPCODES16(1) OPCODES16(2) OPCODES16(3)
+  OPCODES16(4) OPCODES16(5) OPCODES16(6) OPCODES16(7)
+  OPCODES16(8) OPCODES16(9) OPCODES16(a) OPCODES16(b)
+  OPCODES16(c) OPCODES16(d) OPCODES16(e) OPCODES16(f)
+}
+
+#elif !defined(BLOCKCACHE) // that has its own step() in z80_blockcache.cpp
+
+void z80::step(uint16_t count)
+{
+  while (count--) {
+    PROFILEPC(pcreg);
+    tempb=fetch();
+    #ifdef INSTRUCTIONPROFILER
+    profilercounts[tempb]++;
+    #endif
+    #ifdef INSTRUCTIONCOUNTER
+    profilecounter++;
+    #endif
+    #ifdef INCREMENTREFRESHREGISTER
+    ir.bytes.low++;
+    #endif
+    CYCLES(z80_cycles[tempb]);
+    (this->*maintable[tempb])();
+    checkforinterrupts();
+  }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2018 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <string.h>
+#include <sys/mman.h>
+#include "z80.hpp"
+
+/*
+Second tier for the block cache. A cached block that has been entered
+JITTHRESHOLD times gets compiled into x86-64 code that for every instruction
+sets fetchp to the recorded bytes, advances pcreg past the prefix, does the
+per opcode profiling and calls the instruction handler directly.
+After each call it checks that pcreg is at the next recorded instruction and
+that the block has not been invalidated, and returns the number of
+instructions run if either check fails. This removes the dispatch loop, but
+the instructions themselves are still the handlers from z80_handlers.cpp.
+
+Compiling stops at the first instruction doing I/O, those and everything
+after them in the block are left to the interpreter in step(). Compiled code
+does not call checkforinterrupts(). Code lives in an mmap()ed arena that is
+reset along with the block cache, so there is nothing to free when blocks
+get dropped.
+*/
+
+#ifdef JIT
+
+// room needed for one compiled instruction, and for entry and exit code
+#define JITOPSIZE 128
+#define JITEXITSIZE 16
+
+// true if the instruction goes through readio() or writeio()
+static bool isio(const uint8_t *b)
+{
+  if (b[0]==0xdd || b[0]==0xfd)
+    b++;
+  switch (b[0]) {
+    case 0xdb: // in a,(n)
+    case 0xd3: // out (n),a
+      return true;
+    case 0xed: // in r,(c), out (c),r and the block i/o instructions
+      return (b[1]&0xc6)==0x40 || (b[1]&0xe6)==0xa2;
+  }
+  return false;
+}
+
+static uint8_t *emit8(uint8_t *p,uint8_t b)
+{
+  *p++=b;
+  return p;
+}
+
+static uint8_t *emit16(uint8_t *p,uint16_t w)
+{
+  memcpy(p,&w,sizeof(w));
+  return p+sizeof(w);
+}
+
+static uint8_t *emit32(uint8_t *p,uint32_t d)
+{
+  memcpy(p,&d,sizeof(d));
+  return p+sizeof(d);
+}
+
+static uint8_t *emit64(uint8_t *p,uint64_t q)
+{
+  memcpy(p,&q,sizeof(q));
+  return p+sizeof(q);
+}
+
+static uint8_t *emitbytes(uint8_t *p,const char *s,uint8_t n)
+{
+  memcpy(p,s,n);
+  return p+n;
+}
+
+// mov rax,imm64
+static uint8_t *movrax(uint8_t *p,const void *v)
+{
+  p=emitbytes(p,"\x48\xb8",2);
+  return emit64(p,(uint64_t)v);
+}
+
+// mov eax,n; pop rbx; ret
+static uint8_t *emitexit(uint8_t *p,uint16_t n)
+{
+  p=emit8(p,0xb8);
+  p=emit32(p,n);
+  return emitbytes(p,"\x5b\xc3",2);
+}
+
+#if defined(PCPROFILER) && defined(CYCLECOUNTER)
+// generated code calls this, member functions have no fixed address
+static void jitprofilepc(z80 *cpu,uint16_t pc)
+{
+  cpu->profilepc(pc);
+}
+#endif
+
+z80::~z80()
+{
+  if (jitarena)
+    munmap(jitarena,JITARENA);
+}
+
+void z80::compileblock(uint16_t first)
+{
+cachedop *op=&cacheops[first];
+uint8_t *code,*p;
+uint8_t *exits[BLOCKMAXOPS];
+uint16_t n=0,i;
+int32_t pcofs=(uint8_t*)&pcreg-(uint8_t*)this;
+int32_t fetchpofs=(uint8_t*)&fetchp-(uint8_t*)this;
+int32_t brokenofs=(uint8_t*)&blockbroken-(uint8_t*)this;
+#ifdef INCREMENTREFRESHREGISTER
+int32_t refreshofs=(uint8_t*)&ir.bytes.low-(uint8_t*)this;
+#endif
+#ifdef CYCLECOUNTER
+int32_t cyclesofs=(uint8_t*)&cycles-(uint8_t*)this;
+#endif
+void *fn[2];
+  if (!jitarena) {
+    jitarena=(uint8_t*)mmap(NULL,JITARENA,PROT_READ|PROT_WRITE|PROT_EXEC,
+      MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (jitarena==MAP_FAILED) {
+      jitarena=NULL;
+      return;
+    }
+  }
+  // the arena is only reset together with the cache, so the block being
+  // compiled is not lost if it has filled up
+  if (jitused+JITEXITSIZE+BLOCKMAXOPS*(JITOPSIZE+JITEXITSIZE)>JITARENA)
+    return;
+  code=p=jitarena+jitused;
+  p=emitbytes(p,"\x53\x48\x89\xfb",4); // push rbx; mov rbx,rdi
+  for (;op->n && !isio(op->bytes);op++,n++) {
+    // non virtual member function pointer is the address and a this
+    // adjustment, the latter is always 0 here
+    memcpy(fn,&op->h,sizeof(fn));
+    // mov rax,&op->bytes[skip]; mov [rbx+fetchp],rax
+    p=movrax(p,&op->bytes[op->skip]);
+    p=emitbytes(p,"\x48\x89\x83",3);
+    p=emit32(p,fetchpofs);
+    // add word [rbx+pcreg],skip
+    p=emitbytes(p,"\x66\x83\x83",3);
+    p=emit32(p,pcofs);
+    p=emit8(p,op->skip);
+    #if defined(PCPROFILER) && defined(CYCLECOUNTER)
+    // mov rdi,rbx; mov esi,pc; mov rax,jitprofilepc; call rax
+    p=emitbytes(p,"\x48\x89\xdf\xbe",4);
+    p=emit32(p,op->pc);
+    p=movrax(p,(void*)jitprofilepc);
+    p=emitbytes(p,"\xff\xd0",2);
+    #elif defined(PCPROFILER)
+    // mov rax,&pccounts[pc]; inc qword [rax]
+    p=movrax(p,&pccounts[op->pc]);
+    p=emitbytes(p,"\x48\xff\x00",3);
+    #endif
+    #ifdef INSTRUCTIONPROFILER
+    // mov rax,&profilercounts[opcode]; inc qword [rax]
+    p=movrax(p,&profilercounts[op->bytes[0]]);
+    p=emitbytes(p,"\x48\xff\x00",3);
+    #endif
+    #ifdef INCREMENTREFRESHREGISTER
+    // inc byte [rbx+refresh]
+    p=emitbytes(p,"\xfe\x83",2);
+    p=emit32(p,refreshofs);
+    #endif
+    #ifdef CYCLECOUNTER
+    // add qword [rbx+cycles],n
+    p=emitbytes(p,"\x48\x83\x83",3);
+    p=emit32(p,cyclesofs);
+    p=emit8(p,op->cycles);
+    #endif
+    // mov rdi,rbx; mov rax,handler; call rax
+    p=emitbytes(p,"\x48\x89\xdf",3);
+    p=movrax(p,fn[0]);
+    p=emitbytes(p,"\xff\xd0",2);
+    // cmp byte [rbx+blockbroken],0; jne exit
+    p=emitbytes(p,"\x80\xbb",2);
+    p=emit32(p,brokenofs);
+    p=emitbytes(p,"\x00\x0f\x85",3);
+    p=emit32(p,0);
+    exits[n]=p;
+    // cmp word [rbx+pcreg],nextpc; jne exit
+    p=emitbytes(p,"\x66\x81\xbb",3);
+    p=emit32(p,pcofs);
+    p=emit16(p,op[1].pc);
+    p=emitbytes(p,"\x0f\x85",2);
+    p=emit32(p,0);
+  }
+  if (!n) {
+    blockhits[first]=0;
+    return;
+  }
+  p=emitexit(p,n);
+  // both jumps after each instruction lead to the same exit
+  for (i=0;i<n;i++) {
+    emit32(exits[i]-4,p-exits[i]);
+    emit32(exits[i]+11,p-(exits[i]+15));
+    p=emitexit(p,i+1);
+  }
+  jitused=p-jitarena;
+  blockcode[first]=(jitblock)code;
+}
+
+#endif